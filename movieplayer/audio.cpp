@@ -12,6 +12,7 @@
 #include <OpenAL/alc.h>
 
 #include "decoder.h"
+#include "session.h"
 
 namespace jf {
 	
@@ -43,11 +44,18 @@ namespace jf {
 	static OpenALInit openALInit;
 	
 	AudioPlayer::AudioPlayer()
-	:	demuxer(NULL)
+	:	state(Stopped)
+	,	demuxer(NULL)
 	,	audioDecoder(NULL)
+	,	session(NULL)
 	,	uid(0)
 	,	killUpdateThread(false)
 	,	clock(0.f)
+	,	queuedHead(0)
+	,	queuedCount(0)
+	,	seekPending(false)
+	,	seekTime(0.f)
+	,	seekLatency(0.f)
 	{}
 	
 	AudioPlayer::~AudioPlayer() {
@@ -57,12 +65,26 @@ namespace jf {
 	bool AudioPlayer::open(const char* path) {
 		close();
 		
-		if(!(demuxer = Demuxer::open(path)))
+		if(!(demuxer = Demuxer::open(path, 0, StreamSelection().setVideo(false))))
 			return false;
 		
 		if(!(audioDecoder = AudioDecoder::open(demuxer)))
 			return false;
 		
+		return openSource();
+	}
+	
+	bool AudioPlayer::open(MediaSession* s) {
+		close();
+		
+		if(!s || !(audioDecoder = s->getAudioDecoder()))
+			return false;
+		session = s;
+		
+		return openSource();
+	}
+	
+	bool AudioPlayer::openSource() {
 		alGenSources(1, &uid);
 		alSourcef(uid, AL_PITCH, 1.f);
 		alSourcef(uid, AL_GAIN, 1.f);
@@ -100,6 +122,11 @@ namespace jf {
 			memset(buffers, 0, sizeof(uint32_t)*BufferCount);
 		}
 		
+		// the session's decoder isn't ours to delete
+		if(session) {
+			audioDecoder = NULL;
+			session = NULL;
+		}
 		if(audioDecoder) {
 			delete audioDecoder;
 			audioDecoder = NULL;
@@ -111,25 +138,54 @@ namespace jf {
 	}
 	
 	void AudioPlayer::play() {
-		if(state != Playing) {
-			killUpdateThread = false;
-			updateThread = std::thread(std::bind(&AudioPlayer::updateBuffers,this));
-
-			for(int i=0; i<BufferCount; i++) {
-				AudioBuffer::Ptr buf = audioDecoder->nextBuffer();
-				if(buf) {
-					alBufferData(buffers[i], format, buf->bytes, buf->numBytes, buf->sampleRate);
-					AL_ASSERT_NO_ERROR();
-				}
-			}
-			
-			alSourceQueueBuffers(uid, BufferCount, buffers);
-			AL_ASSERT_NO_ERROR();
-			
+		if(state == Playing)
+			return;
+		
+		// the update thread keeps going through a pause, only the source stopped
+		if(state == Paused && updateThread.joinable()) {
 			alSourcePlay(uid);
 			AL_ASSERT_NO_ERROR();
 			state = Playing;
+			return;
+		}
+		
+		// finished by itself, whatever it left queued goes
+		if(updateThread.joinable())
+			updateThread.join();
+		alSourceStop(uid);
+		alSourcei(uid, AL_BUFFER, 0);
+		AL_ASSERT_NO_ERROR();
+		
+		// one that came in as the update thread was stopping
+		applySeek();
+		
+		// filled before the update thread starts, the decoder's packet
+		// queue only takes one reader
+		{
+			std::lock_guard<std::mutex> lock(clockMutex);
+			queuedHead = queuedCount = 0;
 		}
+		int filled = 0;
+		for(; filled<BufferCount; filled++) {
+			AudioBuffer::Ptr buf = audioDecoder->nextBuffer();
+			if(!buf)
+				break;
+			alBufferData(buffers[filled], format, buf->bytes, buf->numBytes, buf->sampleRate);
+			AL_ASSERT_NO_ERROR();
+			
+			std::lock_guard<std::mutex> lock(clockMutex);
+			pushTempo(buf->tempo);
+		}
+		
+		alSourceQueueBuffers(uid, filled, buffers);
+		AL_ASSERT_NO_ERROR();
+		
+		alSourcePlay(uid);
+		AL_ASSERT_NO_ERROR();
+		state = Playing;
+		
+		killUpdateThread = false;
+		updateThread = std::thread(std::bind(&AudioPlayer::updateBuffers,this));
 	}
 	
 	void AudioPlayer::pause() {
@@ -143,7 +199,8 @@ namespace jf {
 	void AudioPlayer::stop() {
 		if(state != Stopped) {
 			killUpdateThread = true;
-			updateThread.join();
+			if(updateThread.joinable())
+				updateThread.join();
 			
 			alSourceStop(uid);
 			alSourcei(uid, AL_BUFFER, 0);
@@ -153,15 +210,40 @@ namespace jf {
 	}
 	
 	void AudioPlayer::seek(float f) {
-		bool wasPlaying = isPlaying();
+		// the video seeks the shared demuxer, the update thread sees the jump
+		if(session && session->getVideoDecoder()) {
+			session->seekToTime(f);
+			return;
+		}
 		
-		stop();
+		{
+			std::lock_guard<std::mutex> lock(seekMutex);
+			seekTime = f;
+			seekPending = true;
+			seekRequested = std::chrono::steady_clock::now();
+		}
 		
-		clock = f;
-		audioDecoder->seekToTime(f);
+		// nothing queued, play() fills the buffers from here
+		if(state != Playing && state != Paused)
+			applySeek();
+	}
+	
+	bool AudioPlayer::applySeek() {
+		float f;
+		{
+			std::lock_guard<std::mutex> lock(seekMutex);
+			if(!seekPending)
+				return false;
+			seekPending = false;
+			f = seekTime;
+		}
 		
-		if(wasPlaying)
-			play();
+		{
+			std::lock_guard<std::mutex> lock(clockMutex);
+			clock = f;
+		}
+		audioDecoder->seekToTime(f);
+		return true;
 	}
 	
 	void AudioPlayer::setLooping(bool b) { loop = b; }
@@ -171,12 +253,40 @@ namespace jf {
 		alSourcef(uid, AL_GAIN, f);
 	}
 	
+	void AudioPlayer::setTempo(float t) {
+		if(audioDecoder)
+			audioDecoder->setTempo(t);
+	}
+	
+	float AudioPlayer::getTempo() const { return audioDecoder ? audioDecoder->getTempo() : 1.f; }
+	
+	float AudioPlayer::getSeekLatency() const { return seekLatency; }
+	
 	float AudioPlayer::getTime() const {
+		// the offset starts over as each buffer is unqueued, read it with the clock that goes with it
+		std::lock_guard<std::mutex> lock(clockMutex);
 		float time = 0.f;
 		alGetSourcef(uid, AL_SEC_OFFSET, &time);
+		// the offset is in played seconds, the buffer it's in may be stretched
+		if(queuedCount > 0)
+			time *= queuedTempo[queuedHead];
 		return clock + time;
 	}
 	
+	void AudioPlayer::pushTempo(float tempo) {
+		queuedTempo[(queuedHead + queuedCount) % BufferCount] = tempo;
+		queuedCount = std::min(queuedCount + 1, (int)BufferCount);
+	}
+	
+	float AudioPlayer::popTempo() {
+		if(queuedCount == 0)
+			return 1.f;
+		float tempo = queuedTempo[queuedHead];
+		queuedHead = (queuedHead + 1) % BufferCount;
+		queuedCount--;
+		return tempo;
+	}
+	
 	bool AudioPlayer::isPlaying() const { return state == Playing; }
 	bool AudioPlayer::isPaused() const { return state == Paused; }
 	bool AudioPlayer::isStopped() const { return state == Stopped; }
@@ -185,11 +295,61 @@ namespace jf {
 
 	void AudioPlayer::updateBuffers() {
 		while(!killUpdateThread) {
+			bool seeked = applySeek();
+			if(seeked || audioDecoder->hasJumped()) {
+				// throw out what's queued and refill from the new spot
+				alSourceStop(uid);
+				alSourcei(uid, AL_BUFFER, 0);
+				AL_ASSERT_NO_ERROR();
+				
+				{
+					std::lock_guard<std::mutex> lock(clockMutex);
+					queuedHead = queuedCount = 0;
+				}
+				int filled = 0;
+				for(; filled<BufferCount; filled++) {
+					AudioBuffer::Ptr buf = audioDecoder->nextBuffer();
+					if(!buf)
+						break;
+					alBufferData(buffers[filled], format, buf->bytes, buf->numBytes, buf->sampleRate);
+					AL_ASSERT_NO_ERROR();
+					
+					std::lock_guard<std::mutex> lock(clockMutex);
+					pushTempo(buf->tempo);
+					
+					// somebody else's seek, wherever the audio came out is the time
+					if(filled == 0 && !seeked)
+						clock = buf->outTime;
+				}
+				
+				alSourceQueueBuffers(uid, filled, buffers);
+				AL_ASSERT_NO_ERROR();
+				if(state == Playing)
+					alSourcePlay(uid);
+				if(!seeked)
+					continue;
+				
+				std::lock_guard<std::mutex> lock(seekMutex);
+				seekLatency = std::chrono::duration<float>(std::chrono::steady_clock::now() - seekRequested).count();
+				continue;
+			}
+			
 			if(audioDecoder->isLastBuffer()) {
-				if(loop) {
+				VideoDecoder* video = session ? session->getVideoDecoder() : NULL;
+				if(loop && !video) {
 					audioDecoder->seekToTime(0.0);
 					continue;
 				}
+				else if(loop) {
+					// the whole session goes back once the picture's shown its last
+					// frame, or once we've played out and its clock can't move on
+					ALint playing = AL_PLAYING;
+					alGetSourcei(uid, AL_SOURCE_STATE, &playing);
+					if(video->isLastFrame() || (state == Playing && playing != AL_PLAYING)) {
+						session->seekToTime(0.0);
+						continue;
+					}
+				}
 				else {
 					state = Finished;
 					break;
@@ -202,18 +362,27 @@ namespace jf {
 
 			if(processed > 0) {
 				ALuint buffs[BufferCount];
-				alSourceUnqueueBuffers(uid, processed, buffs);
-				AL_ASSERT_NO_ERROR();
-
-				for(int i=0; i<processed; i++) {
-					clock += (audioDecoder->getFrameSize() / audioDecoder->getSampleSize() / (float)audioDecoder->getChannelCount()) / (float)audioDecoder->getSampleRate();
+				{
+					// the offset and the clock move together
+					std::lock_guard<std::mutex> lock(clockMutex);
+					alSourceUnqueueBuffers(uid, processed, buffs);
+					AL_ASSERT_NO_ERROR();
 					
+					// a stretched buffer covers tempo times its length of movie
+					for(int i=0; i<processed; i++)
+						clock += (audioDecoder->getFrameSize() / audioDecoder->getSampleSize() / (float)audioDecoder->getOutputChannelCount()) / (float)audioDecoder->getSampleRate() * popTempo();
+				}
+				
+				for(int i=0; i<processed; i++) {
 					AudioBuffer::Ptr buf = audioDecoder->nextBuffer();
 					if(!buf)
 						break;
 					
 					alBufferData(buffs[i], format, buf->bytes, buf->numBytes, buf->sampleRate);
 					AL_ASSERT_NO_ERROR();
+					
+					std::lock_guard<std::mutex> lock(clockMutex);
+					pushTempo(buf->tempo);
 				}
 				
 				alSourceQueueBuffers(uid, processed, buffs);
@@ -10,11 +10,15 @@
 
 #include <cstdint>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 namespace jf {
 	
 	class Demuxer;
 	class AudioDecoder;
+	class MediaSession;
 	
 	class AudioPlayer {
 	public:
@@ -22,16 +26,29 @@ namespace jf {
 		~AudioPlayer();
 		
 		bool open(const char*);
+		// plays the session's audio, which stays the session's. seeks move the
+		// session's video along with it, and looping starts both over once
+		// the audio and the picture have reached the end
+		bool open(MediaSession* session);
 		void close();
 		void play();
 		void pause();
 		void stop();
+		// doesn't wait while playing, the update thread starts over from the
+		// newest request and any in between are dropped
 		void seek(float f);
 		
 		void setLooping(bool b);
 		void setVolume(float v); // 0 - 1
+		// 0.25 - 16 times as fast without the pitch changing, kicks in a
+		// few buffers later
+		void setTempo(float t);
+		float getTempo() const;
 		
+		// in movie time, so it runs tempo times as fast as the wall clock
 		float getTime() const;
+		// seconds from the last seek() while playing to its audio being queued
+		float getSeekLatency() const;
 		
 		bool isPlaying() const;
 		bool isPaused() const;
@@ -40,27 +57,51 @@ namespace jf {
 		bool isLooping() const;
 		
 	private:
-		enum {
+		enum State {
 			Playing,
 			Paused,
 			Stopped,
 			Finished
-		} state;
+		};
+		// the update thread sets Finished
+		std::atomic<State> state;
+		
+		// sets up the source once there's a decoder
+		bool openSource();
 		
 		Demuxer* demuxer;
 		AudioDecoder* audioDecoder;
+		MediaSession* session;
 		
 		static const int BufferCount = 3;
 		
 		uint32_t uid;
 		uint32_t buffers[BufferCount];
 		uint32_t format;
-		float clock;
 		bool loop;
 		
+		// the update thread moves these along as buffers finish and getTime()
+		// reads them on the caller's, clockMutex guards the lot
+		mutable std::mutex clockMutex;
+		float clock;
+		// tempo of each buffer queued on the source, oldest first. callers
+		// hold clockMutex
+		void pushTempo(float tempo);
+		float popTempo();
+		float queuedTempo[BufferCount];
+		int queuedHead, queuedCount;
+		
 		void updateBuffers();
 		std::thread updateThread;
-		bool killUpdateThread;
+		std::atomic<bool> killUpdateThread;
+		
+		// true if there was a seek waiting
+		bool applySeek();
+		std::mutex seekMutex;
+		bool seekPending;
+		float seekTime;
+		std::chrono::steady_clock::time_point seekRequested;
+		float seekLatency;
 	};
 	
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+//
+//  clock.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "clock.h"
+#include "audio.h"
+
+namespace jf {
+	
+	MasterClock::~MasterClock() {}
+	
+	ExternalClock::ExternalClock(Source s)
+	:	source(s)
+	,	start(Clock::now())
+	,	base(0.0)
+	,	rate(1.f)
+	,	paused(true)
+	{}
+	
+	MasterClock::Source ExternalClock::getSource() const { return source; }
+	
+	double ExternalClock::getTime() const {
+		if(paused)
+			return base;
+		return base + std::chrono::duration<double>(Clock::now() - start).count() * rate;
+	}
+	
+	void ExternalClock::setTime(double time) {
+		base = time;
+		start = Clock::now();
+	}
+	
+	void ExternalClock::setRate(float r) {
+		setTime(getTime());
+		rate = r;
+	}
+	
+	float ExternalClock::getRate() const { return rate; }
+	
+	void ExternalClock::pause() {
+		if(!paused) {
+			base = getTime();
+			paused = true;
+		}
+	}
+	
+	void ExternalClock::resume() {
+		if(paused) {
+			start = Clock::now();
+			paused = false;
+		}
+	}
+	
+	bool ExternalClock::isPaused() const { return paused; }
+	
+	AudioClock::AudioClock(const AudioPlayer* p)
+	:	player(p)
+	{}
+	
+	MasterClock::Source AudioClock::getSource() const { return Audio; }
+	double AudioClock::getTime() const { return player ? player->getTime() : 0.0; }
+	
+}
@@ -0,0 +1,70 @@
+//
+//  clock.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include <chrono>
+
+namespace jf {
+	
+	class AudioPlayer;
+	
+	// where playback has got to in movie seconds. a player slaves its video
+	// to one of these so audio, video and anything else agree on the time
+	class MasterClock {
+	public:
+		enum Source {
+			Audio,		// what the sound card has actually played
+			Video,		// a video player's own timeline
+			External	// wall time, driven by whoever owns it
+		};
+		
+		virtual ~MasterClock();
+		virtual Source getSource() const =0;
+		virtual double getTime() const =0;
+	};
+	
+	// wall time at rate times real time, stands still while paused
+	class ExternalClock : public MasterClock {
+	public:
+		ExternalClock(Source source=External);
+		
+		Source getSource() const;
+		double getTime() const;
+		
+		void setTime(double time);
+		// carries on from the current time at the new rate
+		void setRate(float rate);
+		float getRate() const;
+		
+		void pause();
+		void resume();
+		bool isPaused() const;
+		
+	private:
+		typedef std::chrono::steady_clock Clock;
+		
+		Source source;
+		Clock::time_point start;
+		double base;
+		float rate;
+		bool paused;
+	};
+	
+	// follows an AudioPlayer, which only moves as fast as its buffers play
+	class AudioClock : public MasterClock {
+	public:
+		AudioClock(const AudioPlayer* player);
+		
+		Source getSource() const;
+		double getTime() const;
+		
+	private:
+		const AudioPlayer* player;
+	};
+	
+}
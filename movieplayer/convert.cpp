@@ -0,0 +1,483 @@
+//
+//  convert.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "convert.h"
+#include "workers.h"
+
+extern "C" {
+	#include <libavutil/cpu.h>
+	#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define JF_X86 1
+	#include <immintrin.h>
+#endif
+
+namespace jf {
+	
+	YUVCoefficients YUVCoefficients::get(AVColorSpace colorSpace, bool fullRange, int height) {
+		bool bt709 = colorSpace == AVCOL_SPC_BT709 || (colorSpace == AVCOL_SPC_UNSPECIFIED && height >= 720);
+		float kr = bt709 ? 0.2126f : 0.299f;
+		float kb = bt709 ? 0.0722f : 0.114f;
+		float kg = 1.f - kr - kb;
+		
+		// limited range luma is 16-235, chroma 16-240
+		float cs = fullRange ? 1.f : 255.f / 224.f;
+		
+		YUVCoefficients k;
+		k.yOffset = fullRange ? 0.f : 16.f / 255.f;
+		k.yScale = fullRange ? 1.f : 255.f / 219.f;
+		k.vToR = 2.f * (1.f - kr) * cs;
+		k.uToG = 2.f * kb * (1.f - kb) / kg * cs;
+		k.vToG = 2.f * kr * (1.f - kr) / kg * cs;
+		k.uToB = 2.f * (1.f - kb) * cs;
+		return k;
+	}
+	
+	void yuvToRgb(AVColorSpace colorSpace, bool fullRange, int height, glm::mat3& m, glm::vec3& offset) {
+		YUVCoefficients k = YUVCoefficients::get(colorSpace, fullRange, height);
+		
+		m = glm::mat3(glm::vec3(k.yScale, k.yScale, k.yScale),
+					  glm::vec3(0.f, -k.uToG, k.uToB),
+					  glm::vec3(k.vToR, -k.vToG, 0.f));
+		offset = glm::vec3(k.yOffset, 128.f / 255.f, 128.f / 255.f);
+	}
+	
+	// 16.16 fixed point version of the coefficients
+	struct FixedCoefficients {
+		int32_t yOffset, yScale;
+		int32_t vToR, uToG, vToG, uToB;
+		
+		FixedCoefficients(const YUVCoefficients& k)
+		:	yOffset((int32_t)(k.yOffset * 255.f + 0.5f))
+		,	yScale((int32_t)(k.yScale * 65536.f + 0.5f))
+		,	vToR((int32_t)(k.vToR * 65536.f + 0.5f))
+		,	uToG((int32_t)(k.uToG * 65536.f + 0.5f))
+		,	vToG((int32_t)(k.vToG * 65536.f + 0.5f))
+		,	uToB((int32_t)(k.uToB * 65536.f + 0.5f))
+		{}
+	};
+	
+	// where each channel goes in a little endian 32 bit pixel
+	struct PixelLayout {
+		int bytesPerPixel;
+		int rShift, gShift, bShift;
+		uint32_t alpha;
+		
+		PixelLayout(PixelFormat fmt)
+		:	bytesPerPixel(fmt == PIX_FMT_RGB24 ? 3 : 4)
+		,	rShift(fmt == PIX_FMT_BGRA ? 16 : 0)
+		,	gShift(8)
+		,	bShift(fmt == PIX_FMT_BGRA ? 0 : 16)
+		,	alpha(fmt == PIX_FMT_RGB24 ? 0 : 0xFF000000)
+		{}
+	};
+	
+	// one row of pixels. for NV12 u points at the interleaved plane and v is ignored
+	typedef void (*RowKernel)(const uint8_t* y, const uint8_t* u, const uint8_t* v, bool interleaved,
+							  uint8_t* dst, int width, const PixelLayout& layout, const FixedCoefficients& k);
+	
+	static inline uint8_t clamp255(int32_t v) {
+		return (uint8_t)std::max(0, std::min(255, v));
+	}
+	
+	// the reference every other kernel has to match
+	static void rowScalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, bool interleaved,
+						  uint8_t* dst, int width, const PixelLayout& layout, const FixedCoefficients& k)
+	{
+		for(int x=0; x<width; x++) {
+			int c = interleaved ? (x >> 1) * 2 : (x >> 1);
+			int32_t cu = u[c] - 128;
+			int32_t cv = (interleaved ? u[c + 1] : v[c]) - 128;
+			int32_t yy = (y[x] - k.yOffset) * k.yScale + (1 << 15);
+			
+			uint32_t r = clamp255((yy + k.vToR * cv) >> 16);
+			uint32_t g = clamp255((yy - k.uToG * cu - k.vToG * cv) >> 16);
+			uint32_t b = clamp255((yy + k.uToB * cu) >> 16);
+			uint32_t px = (r << layout.rShift) | (g << layout.gShift) | (b << layout.bShift) | layout.alpha;
+			
+			uint8_t* out = dst + x * layout.bytesPerPixel;
+			out[0] = px & 0xFF;
+			out[1] = (px >> 8) & 0xFF;
+			out[2] = (px >> 16) & 0xFF;
+			if(layout.bytesPerPixel == 4)
+				out[3] = px >> 24;
+		}
+	}
+
+#if JF_X86
+	// 4 pixels at a time in 32 bit lanes, pmovzx and pmulld need sse4.1
+	__attribute__((target("sse4.1")))
+	static void rowSSE41(const uint8_t* y, const uint8_t* u, const uint8_t* v, bool interleaved,
+						 uint8_t* dst, int width, const PixelLayout& layout, const FixedCoefficients& k)
+	{
+		const __m128i yOffset = _mm_set1_epi32(k.yOffset);
+		const __m128i yScale = _mm_set1_epi32(k.yScale);
+		const __m128i vToR = _mm_set1_epi32(k.vToR);
+		const __m128i uToG = _mm_set1_epi32(k.uToG);
+		const __m128i vToG = _mm_set1_epi32(k.vToG);
+		const __m128i uToB = _mm_set1_epi32(k.uToB);
+		const __m128i half = _mm_set1_epi32(1 << 15);
+		const __m128i bias = _mm_set1_epi32(128);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i full = _mm_set1_epi32(255);
+		const __m128i alpha = _mm_set1_epi32(layout.alpha);
+		const __m128i rShift = _mm_cvtsi32_si128(layout.rShift);
+		const __m128i gShift = _mm_cvtsi32_si128(layout.gShift);
+		const __m128i bShift = _mm_cvtsi32_si128(layout.bShift);
+		const __m128i dropAlpha = _mm_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+		
+		int x = 0;
+		for(; x + 4 <= width; x += 4) {
+			int32_t bits;
+			memcpy(&bits, y + x, 4);
+			__m128i Y = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bits));
+			
+			__m128i U, V;
+			if(interleaved) {
+				memcpy(&bits, u + x, 4);
+				__m128i uv = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bits));
+				U = _mm_shuffle_epi32(uv, _MM_SHUFFLE(2,2,0,0));
+				V = _mm_shuffle_epi32(uv, _MM_SHUFFLE(3,3,1,1));
+			}
+			else {
+				uint16_t pair;
+				memcpy(&pair, u + x / 2, 2);
+				U = _mm_shuffle_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(pair)), _MM_SHUFFLE(1,1,0,0));
+				memcpy(&pair, v + x / 2, 2);
+				V = _mm_shuffle_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(pair)), _MM_SHUFFLE(1,1,0,0));
+			}
+			U = _mm_sub_epi32(U, bias);
+			V = _mm_sub_epi32(V, bias);
+			
+			__m128i yy = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(Y, yOffset), yScale), half);
+			__m128i R = _mm_srai_epi32(_mm_add_epi32(yy, _mm_mullo_epi32(V, vToR)), 16);
+			__m128i G = _mm_srai_epi32(_mm_sub_epi32(_mm_sub_epi32(yy, _mm_mullo_epi32(U, uToG)), _mm_mullo_epi32(V, vToG)), 16);
+			__m128i B = _mm_srai_epi32(_mm_add_epi32(yy, _mm_mullo_epi32(U, uToB)), 16);
+			
+			R = _mm_min_epi32(_mm_max_epi32(R, zero), full);
+			G = _mm_min_epi32(_mm_max_epi32(G, zero), full);
+			B = _mm_min_epi32(_mm_max_epi32(B, zero), full);
+			
+			__m128i px = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(R, rShift), _mm_sll_epi32(G, gShift)),
+									  _mm_or_si128(_mm_sll_epi32(B, bShift), alpha));
+			
+			if(layout.bytesPerPixel == 4) {
+				_mm_storeu_si128((__m128i*)(dst + x * 4), px);
+			}
+			else {
+				// exactly 12 bytes, so slices never write into each other's rows
+				px = _mm_shuffle_epi8(px, dropAlpha);
+				_mm_storel_epi64((__m128i*)(dst + x * 3), px);
+				bits = _mm_extract_epi32(px, 2);
+				memcpy(dst + x * 3 + 8, &bits, 4);
+			}
+		}
+		
+		if(x < width) {
+			int c = interleaved ? x : x / 2;
+			rowScalar(y + x, u + c, v + c, interleaved, dst + x * layout.bytesPerPixel, width - x, layout, k);
+		}
+	}
+	
+	// same as the sse4.1 kernel, 8 pixels at a time
+	__attribute__((target("avx2")))
+	static void rowAVX2(const uint8_t* y, const uint8_t* u, const uint8_t* v, bool interleaved,
+						uint8_t* dst, int width, const PixelLayout& layout, const FixedCoefficients& k)
+	{
+		const __m256i yOffset = _mm256_set1_epi32(k.yOffset);
+		const __m256i yScale = _mm256_set1_epi32(k.yScale);
+		const __m256i vToR = _mm256_set1_epi32(k.vToR);
+		const __m256i uToG = _mm256_set1_epi32(k.uToG);
+		const __m256i vToG = _mm256_set1_epi32(k.vToG);
+		const __m256i uToB = _mm256_set1_epi32(k.uToB);
+		const __m256i half = _mm256_set1_epi32(1 << 15);
+		const __m256i bias = _mm256_set1_epi32(128);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i full = _mm256_set1_epi32(255);
+		const __m256i alpha = _mm256_set1_epi32(layout.alpha);
+		const __m128i rShift = _mm_cvtsi32_si128(layout.rShift);
+		const __m128i gShift = _mm_cvtsi32_si128(layout.gShift);
+		const __m128i bShift = _mm_cvtsi32_si128(layout.bShift);
+		const __m256i dropAlpha = _mm256_setr_epi8(0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1,
+												   0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1);
+		// spread 4 chroma samples across 8 pixels, or pick u and v out of uv pairs
+		const __m256i dup = _mm256_setr_epi32(0,0,1,1,2,2,3,3);
+		const __m256i evens = _mm256_setr_epi32(0,0,2,2,4,4,6,6);
+		const __m256i odds = _mm256_setr_epi32(1,1,3,3,5,5,7,7);
+		
+		int x = 0;
+		for(; x + 8 <= width; x += 8) {
+			__m256i Y = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(y + x)));
+			
+			__m256i U, V;
+			if(interleaved) {
+				__m256i uv = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(u + x)));
+				U = _mm256_permutevar8x32_epi32(uv, evens);
+				V = _mm256_permutevar8x32_epi32(uv, odds);
+			}
+			else {
+				int32_t bits;
+				memcpy(&bits, u + x / 2, 4);
+				U = _mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_cvtsi32_si128(bits)), dup);
+				memcpy(&bits, v + x / 2, 4);
+				V = _mm256_permutevar8x32_epi32(_mm256_cvtepu8_epi32(_mm_cvtsi32_si128(bits)), dup);
+			}
+			U = _mm256_sub_epi32(U, bias);
+			V = _mm256_sub_epi32(V, bias);
+			
+			__m256i yy = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(Y, yOffset), yScale), half);
+			__m256i R = _mm256_srai_epi32(_mm256_add_epi32(yy, _mm256_mullo_epi32(V, vToR)), 16);
+			__m256i G = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_sub_epi32(yy, _mm256_mullo_epi32(U, uToG)), _mm256_mullo_epi32(V, vToG)), 16);
+			__m256i B = _mm256_srai_epi32(_mm256_add_epi32(yy, _mm256_mullo_epi32(U, uToB)), 16);
+			
+			R = _mm256_min_epi32(_mm256_max_epi32(R, zero), full);
+			G = _mm256_min_epi32(_mm256_max_epi32(G, zero), full);
+			B = _mm256_min_epi32(_mm256_max_epi32(B, zero), full);
+			
+			__m256i px = _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(R, rShift), _mm256_sll_epi32(G, gShift)),
+										 _mm256_or_si256(_mm256_sll_epi32(B, bShift), alpha));
+			
+			if(layout.bytesPerPixel == 4) {
+				_mm256_storeu_si256((__m256i*)(dst + x * 4), px);
+			}
+			else {
+				// 12 bytes out of each 128 bit lane
+				px = _mm256_shuffle_epi8(px, dropAlpha);
+				__m128i lo = _mm256_castsi256_si128(px);
+				__m128i hi = _mm256_extracti128_si256(px, 1);
+				int32_t bits;
+				_mm_storel_epi64((__m128i*)(dst + x * 3), lo);
+				bits = _mm_extract_epi32(lo, 2);
+				memcpy(dst + x * 3 + 8, &bits, 4);
+				_mm_storel_epi64((__m128i*)(dst + x * 3 + 12), hi);
+				bits = _mm_extract_epi32(hi, 2);
+				memcpy(dst + x * 3 + 20, &bits, 4);
+			}
+		}
+		
+		if(x < width) {
+			int c = interleaved ? x : x / 2;
+			rowScalar(y + x, u + c, v + c, interleaved, dst + x * layout.bytesPerPixel, width - x, layout, k);
+		}
+	}
+#endif
+	
+	class YUVConverter : public ColorConverter {
+	public:
+		YUVConverter(Kernel kern, PixelFormat src, PixelFormat dst, int w, int h, const YUVCoefficients& k)
+		:	layout(dst)
+		,	coefficients(k)
+		,	interleaved(src == PIX_FMT_NV12)
+		,	row(rowScalar)
+		{
+			kernel = kern;
+			width = w;
+			height = h;
+			sliceAlignment = 2;
+#if JF_X86
+			if(kernel == AVX2)
+				row = rowAVX2;
+			else if(kernel == SSE41)
+				row = rowSSE41;
+#endif
+		}
+		
+		void convert(const uint8_t* const src[], const int srcStride[],
+					 uint8_t* const dst[], const int dstStride[], int begin, int end)
+		{
+			for(int r=begin; r<end; r++) {
+				const uint8_t* y = src[0] + r * srcStride[0];
+				const uint8_t* u = src[1] + (r / 2) * srcStride[1];
+				const uint8_t* v = interleaved ? u + 1 : src[2] + (r / 2) * srcStride[2];
+				row(y, u, v, interleaved, dst[0] + r * dstStride[0], width, layout, coefficients);
+			}
+		}
+	
+	private:
+		PixelLayout layout;
+		FixedCoefficients coefficients;
+		bool interleaved;
+		RowKernel row;
+	};
+	
+	// swscale keeps state between the slices of one picture, so every band
+	// gets its own context working on a picture that's just that band
+	class SwsConverter : public ColorConverter {
+	public:
+		SwsConverter(SwsContext* ctx, PixelFormat src, PixelFormat dst, int w, int h, int srcH)
+		:	sws(ctx)
+		,	srcFormat(src)
+		,	dstFormat(dst)
+		,	srcHeight(srcH)
+		{
+			kernel = Swscale;
+			width = w;
+			height = h;
+			
+			// bands have to start on a chroma row, palettes can't be offset at all,
+			// and scaled pictures go in one piece
+			const AVPixFmtDescriptor* srcDesc = av_pix_fmt_desc_get(src);
+			const AVPixFmtDescriptor* dstDesc = av_pix_fmt_desc_get(dst);
+			if(srcHeight == height && srcDesc && dstDesc && !((srcDesc->flags | dstDesc->flags) & PIX_FMT_PAL))
+				sliceAlignment = 1 << std::max(srcDesc->log2_chroma_h, dstDesc->log2_chroma_h);
+			else
+				sliceAlignment = 0;
+		}
+		
+		~SwsConverter() {
+			sws_freeContext(sws);
+			for(auto& band : bands)
+				sws_freeContext(band.second);
+		}
+		
+		void convert(const uint8_t* const src[], const int srcStride[],
+					 uint8_t* const dst[], const int dstStride[], int begin, int end)
+		{
+			if(begin == 0 && end == height) {
+				sws_scale(sws, src, srcStride, 0, srcHeight, dst, dstStride);
+				return;
+			}
+			
+			SwsContext* band = getBand(begin, end);
+			if(!band)
+				return;
+			
+			const uint8_t* srcBand[4];
+			uint8_t* dstBand[4];
+			offsetPlanes(srcFormat, src, srcStride, begin, srcBand);
+			offsetPlanes(dstFormat, dst, dstStride, begin, dstBand);
+			sws_scale(band, srcBand, srcStride, 0, end - begin, dstBand, dstStride);
+		}
+	
+	private:
+		SwsContext* getBand(int begin, int end) {
+			std::lock_guard<std::mutex> lock(mutex);
+			SwsContext*& band = bands[std::make_pair(begin, end)];
+			if(!band)
+				band = sws_getCachedContext(NULL, width, end - begin, srcFormat, width, end - begin, dstFormat, SWS_BILINEAR, NULL, NULL, NULL);
+			return band;
+		}
+		
+		template<typename T>
+		static void offsetPlanes(PixelFormat fmt, T* const planes[], const int stride[], int row, T* out[4]) {
+			int chromaShift = av_pix_fmt_desc_get(fmt)->log2_chroma_h;
+			for(int i=0; i<4; i++) {
+				int shift = (i == 1 || i == 2) ? chromaShift : 0;
+				out[i] = planes[i] ? planes[i] + (row >> shift) * stride[i] : NULL;
+			}
+		}
+		
+		SwsContext* sws;
+		PixelFormat srcFormat, dstFormat;
+		int srcHeight;
+		
+		// keyed by [begin,end), the same few bands come round every frame
+		std::mutex mutex;
+		std::map<std::pair<int,int>, SwsContext*> bands;
+	};
+	
+	ColorConverter::ColorConverter()
+	:	kernel(Auto)
+	,	width(0)
+	,	height(0)
+	,	sliceAlignment(0)
+	{}
+	
+	ColorConverter::~ColorConverter() {
+	}
+	
+	ColorConverter* ColorConverter::create(PixelFormat src, PixelFormat dst, int width, int height,
+										   AVColorSpace colorSpace, bool fullRange, Kernel kernel)
+	{
+		bool yuvSource = src == PIX_FMT_YUV420P || src == PIX_FMT_YUVJ420P || src == PIX_FMT_NV12;
+		bool rgbDest = dst == PIX_FMT_RGB24 || dst == PIX_FMT_RGBA || dst == PIX_FMT_BGRA;
+		
+		if(yuvSource && rgbDest && kernel != Swscale) {
+			// pick the best kernel the cpu has, never better than what was asked for
+			Kernel best = Scalar;
+#if JF_X86
+			int flags = av_get_cpu_flags();
+			if(flags & AV_CPU_FLAG_SSE4)
+				best = SSE41;
+	#ifdef AV_CPU_FLAG_AVX2
+			if(flags & AV_CPU_FLAG_AVX2)
+				best = AVX2;
+	#endif
+#endif
+			Kernel use = (kernel == Auto) ? best : std::min(kernel, best);
+			
+			bool full = fullRange || src == PIX_FMT_YUVJ420P;
+			return new YUVConverter(use, src, dst, width, height, YUVCoefficients::get(colorSpace, full, height));
+		}
+		
+		if(kernel != Auto && kernel != Swscale)
+			return NULL;
+		
+		SwsContext* sws = sws_getCachedContext(NULL, width, height, src, width, height, dst, SWS_BILINEAR, NULL, NULL, NULL);
+		if(!sws)
+			return NULL;
+		return new SwsConverter(sws, src, dst, width, height, height);
+	}
+	
+	ColorConverter* ColorConverter::create(PixelFormat src, PixelFormat dst, int srcWidth, int srcHeight,
+										   int dstWidth, int dstHeight, AVColorSpace colorSpace, bool fullRange)
+	{
+		if(srcWidth == dstWidth && srcHeight == dstHeight)
+			return create(src, dst, srcWidth, srcHeight, colorSpace, fullRange);
+		
+		// area averages every source pixel when shrinking a long way, bilinear would skip some
+		int flags = (dstWidth * 2 <= srcWidth) ? SWS_AREA : SWS_BILINEAR;
+		SwsContext* sws = sws_getCachedContext(NULL, srcWidth, srcHeight, src, dstWidth, dstHeight, dst, flags, NULL, NULL, NULL);
+		if(!sws)
+			return NULL;
+		return new SwsConverter(sws, src, dst, dstWidth, dstHeight, srcHeight);
+	}
+	
+	void ColorConverter::convertSliced(const uint8_t* const src[], const int srcStride[],
+									   uint8_t* const dst[], const int dstStride[], int slices)
+	{
+		// cut on aligned rows, never into bands smaller than that
+		int units = sliceAlignment ? (height + sliceAlignment - 1) / sliceAlignment : 1;
+		slices = std::max(1, std::min(slices, units));
+		if(slices == 1) {
+			convert(src, srcStride, dst, dstStride, 0, height);
+			return;
+		}
+		
+		WorkerPool::shared().run(slices, [&](int i) {
+			int begin = (units * i / slices) * sliceAlignment;
+			int end = std::min(height, (units * (i + 1) / slices) * sliceAlignment);
+			convert(src, srcStride, dst, dstStride, begin, end);
+		});
+	}
+	
+	ColorConverter::Kernel ColorConverter::getKernel() const {
+		return kernel;
+	}
+	
+	int ColorConverter::getSliceAlignment() const {
+		return sliceAlignment;
+	}
+	
+	const char* ColorConverter::getKernelName(Kernel kernel) {
+		switch(kernel) {
+			case Auto: return "auto";
+			case Scalar: return "scalar";
+			case SSE41: return "sse4.1";
+			case AVX2: return "avx2";
+			case Swscale: return "swscale";
+		}
+		return "unknown";
+	}
+
+}
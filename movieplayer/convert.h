@@ -0,0 +1,76 @@
+//
+//  convert.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+extern "C" {
+	#include <libavutil/avutil.h>
+	#include <libswscale/swscale.h>
+}
+
+#include <glm/glm.hpp>
+
+namespace jf {
+	
+	// how to get from Y'CbCr to R'G'B', shared by the cpu kernels and yuv.frag. with
+	// values in 0-1 and c = 128/255: R = s(Y-o) + vToR(V-c), B = s(Y-o) + uToB(U-c),
+	// G = s(Y-o) - uToG(U-c) - vToG(V-c)
+	struct YUVCoefficients {
+		float yOffset, yScale;
+		float vToR, uToG, vToG, uToB;
+		
+		// untagged hd is almost always 709, untagged sd almost always 601
+		static YUVCoefficients get(AVColorSpace colorSpace, bool fullRange, int height);
+	};
+	
+	// the same coefficients for yuv.frag and wall.frag. matrix columns scale
+	// Y, U and V after the offsets move them to zero
+	void yuvToRgb(AVColorSpace colorSpace, bool fullRange, int height, glm::mat3& m, glm::vec3& offset);
+	
+	// converts pictures between pixel formats, and sizes if asked
+	class ColorConverter {
+	public:
+		enum Kernel {
+			Auto,
+			Scalar,
+			SSE41,
+			AVX2,
+			Swscale
+		};
+		
+		// in-house kernels handle YUV420P/YUVJ420P/NV12 to RGB24/RGBA/BGRA,
+		// anything else goes through swscale. NULL if neither can do it
+		static ColorConverter* create(PixelFormat src, PixelFormat dst, int width, int height,
+									  AVColorSpace colorSpace, bool fullRange, Kernel kernel=Auto);
+		// scaling always goes through swscale in one piece, the rows of a
+		// scaled picture don't map onto bands of the source
+		static ColorConverter* create(PixelFormat src, PixelFormat dst, int srcWidth, int srcHeight,
+									  int dstWidth, int dstHeight, AVColorSpace colorSpace, bool fullRange);
+		virtual ~ColorConverter();
+		
+		// converts rows [begin,end) of the output, begin must be a multiple of getSliceAlignment()
+		virtual void convert(const uint8_t* const src[], const int srcStride[],
+							 uint8_t* const dst[], const int dstStride[], int begin, int end) =0;
+		// converts the whole picture in up to slices horizontal bands on the
+		// shared worker pool, returns once every band is done
+		void convertSliced(const uint8_t* const src[], const int srcStride[],
+						   uint8_t* const dst[], const int dstStride[], int slices);
+		
+		Kernel getKernel() const;
+		// 0 if the picture can't be split
+		int getSliceAlignment() const;
+		static const char* getKernelName(Kernel kernel);
+	
+	protected:
+		ColorConverter();
+		
+		Kernel kernel;
+		int width, height;
+		int sliceAlignment;
+	};
+
+}
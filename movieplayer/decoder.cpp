@@ -7,44 +7,217 @@
 //
 
 #include "decoder.h"
+#include "gopcache.h"
+#include "workers.h"
+#include "timestretch.h"
 
 namespace jf {
 	
 	AVPacket PacketQueue::FlushPacket;
 	
-	PacketQueue::PacketQueue() {
+	PacketQueue::Watermarks::Watermarks()
+	:	lowBytes(256 * 1024)
+	,	highBytes(8 * 1024 * 1024)
+	,	lowDuration(0.5)
+	,	highDuration(2.0)
+	{}
+	
+	PacketQueue::PacketQueue(Demuxer* o, AVRational tb, int capacity)
+	:	owner(o)
+	,	timeBase(tb)
+	,	mask(0)
+	,	slots(NULL)
+	,	tail(0)
+	,	cachedHead(0)
+	,	serial(0)
+	,	pushedBytes(0)
+	,	pushedTicks(0)
+	,	head(0)
+	,	cachedTail(0)
+	,	consumedSerial(0)
+	,	poppedBytes(0)
+	,	poppedTicks(0)
+	,	endOfFile(false)
+	,	backedUp(false)
+	,	consumerWaiting(false)
+	{
 		std::once_flag once;
 		std::call_once(once, [&]() {
 			av_init_packet(&FlushPacket);
 			FlushPacket.data = (uint8_t*)"FLUSH";
 		});
+		
+		// round up to a power of two so indices wrap with a mask
+		uint32_t size = 1;
+		while(size < capacity)
+			size <<= 1;
+		mask = size - 1;
+		slots = new Slot[size];
+		
+		setWatermarks(Watermarks());
+	}
+	
+	PacketQueue::~PacketQueue() {
+		for(uint32_t i = head; i != tail; i++)
+			av_free_packet(&slots[i & mask].packet);
+		delete [] slots;
 	}
 	
 	bool PacketQueue::isEmpty() {
-		return packets.empty();
+		return head.load() == tail.load();
 	}
 	
-	void PacketQueue::push(AVPacket pkt) {
+	bool PacketQueue::push(AVPacket pkt) {
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if(t - cachedHead > mask) {
+			cachedHead = head.load(std::memory_order_acquire);
+			if(t - cachedHead > mask)
+				return false;
+		}
+		
+		// only copies if the packet still points into demuxer-owned memory,
+		// otherwise the packet's buffer just changes hands
 		av_dup_packet(&pkt);
-		packets.push_back(pkt);
+		
+		Slot& slot = slots[t & mask];
+		slot.packet = pkt;
+		slot.serial = serial.load(std::memory_order_relaxed);
+		
+		// single writer, so a plain load and store is enough
+		pushedBytes.store(pushedBytes.load(std::memory_order_relaxed) + pkt.size, std::memory_order_relaxed);
+		pushedTicks.store(pushedTicks.load(std::memory_order_relaxed) + pkt.duration, std::memory_order_relaxed);
+		tail.store(t + 1, std::memory_order_release);
+		
+		notifyConsumer();
+		return true;
 	}
 	
 	int PacketQueue::pop(AVPacket* pkt) {
-		if(!packets.empty()) {
-			*pkt = packets.front();
-			packets.pop_front();
-			return 1;
+		while(true) {
+			// a flush since our last pop, hand out the marker first
+			uint32_t latest = serial.load(std::memory_order_acquire);
+			if(latest != consumedSerial) {
+				consumedSerial = latest;
+				*pkt = FlushPacket;
+				return 1;
+			}
+			
+			uint32_t h = head.load(std::memory_order_relaxed);
+			if(h == cachedTail)
+				cachedTail = tail.load(std::memory_order_acquire);
+			
+			if(h != cachedTail) {
+				Slot& slot = slots[h & mask];
+				if((int32_t)(slot.serial - consumedSerial) > 0) {
+					// pushed after a flush we haven't reported yet
+					consumedSerial = slot.serial;
+					*pkt = FlushPacket;
+					return 1;
+				}
+				
+				// copy out before handing the slot back to the producer
+				AVPacket p = slot.packet;
+				uint32_t slotSerial = slot.serial;
+				bool wasFull = (cachedTail - h) > mask;
+				head.store(h + 1, std::memory_order_release);
+				
+				poppedBytes.store(poppedBytes.load(std::memory_order_relaxed) + p.size, std::memory_order_relaxed);
+				poppedTicks.store(poppedTicks.load(std::memory_order_relaxed) + p.duration, std::memory_order_relaxed);
+				
+				if(owner && (wasFull || isBackedUp() || isHungry()))
+					owner->wakeUp();
+				
+				if(slotSerial != consumedSerial) {
+					// queued before a flush, drop it
+					av_free_packet(&p);
+					continue;
+				}
+				
+				*pkt = p;
+				return 1;
+			}
+			
+			if(endOfFile.load() && serial.load() == consumedSerial && isEmpty())
+				return 0;
+			
+			// nothing there yet. whatever our last pops told the demux
+			// thread, it has to know before we wait on it
+			if(owner)
+				owner->wakeUp();
+			
+			std::unique_lock<std::mutex> lock(mutex);
+			consumerWaiting = true;
+			available.wait(lock, [this]() {
+				return !isEmpty() || endOfFile.load() || serial.load() != consumedSerial;
+			});
+			consumerWaiting = false;
 		}
-		return 0;
 	}
 	
 	void PacketQueue::flush() {
-		for(AVPacket& p : packets) {
-			if(!PacketQueue::isFlushPacket(p))
-				av_free_packet(&p);
+		// clear end of file before bumping the serial so a consumer
+		// that sees the new serial never sees the old end of file
+		endOfFile = false;
+		serial++;
+		notifyConsumer();
+	}
+	
+	void PacketQueue::setEndOfFile() {
+		endOfFile = true;
+		notifyConsumer();
+	}
+	
+	void PacketQueue::notifyConsumer() {
+		// pairs with the consumer setting consumerWaiting before it
+		// re-checks the ring, one of the two sides sees the other
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(consumerWaiting.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			available.notify_all();
 		}
-		packets.clear();
-		packets.push_back(FlushPacket);
+	}
+	
+	void PacketQueue::setWatermarks(const Watermarks& w) {
+		lowBytes = w.lowBytes;
+		highBytes = w.highBytes;
+		lowDuration = w.lowDuration;
+		highDuration = w.highDuration;
+		if(owner)
+			owner->wakeUp();
+	}
+	
+	bool PacketQueue::isFull() {
+		return getBytes() >= highBytes.load(std::memory_order_relaxed) || getDuration() >= highDuration.load(std::memory_order_relaxed);
+	}
+	
+	bool PacketQueue::isHungry() {
+		return getBytes() < lowBytes.load(std::memory_order_relaxed) && getDuration() < lowDuration.load(std::memory_order_relaxed);
+	}
+	
+	bool PacketQueue::isOverflowing() {
+		// hard stop so a starving stream can't make its siblings grow forever
+		return getBytes() >= highBytes.load(std::memory_order_relaxed) * 4;
+	}
+	
+	bool PacketQueue::hasRoom() {
+		return tail.load() - head.load() <= mask;
+	}
+	
+	void PacketQueue::setBackedUp(bool b) {
+		backedUp.store(b, std::memory_order_relaxed);
+	}
+	
+	bool PacketQueue::isBackedUp() {
+		return backedUp.load(std::memory_order_relaxed);
+	}
+	
+	int64_t PacketQueue::getBytes() {
+		return pushedBytes.load(std::memory_order_relaxed) - poppedBytes.load(std::memory_order_relaxed);
+	}
+	
+	double PacketQueue::getDuration() {
+		int64_t ticks = pushedTicks.load(std::memory_order_relaxed) - poppedTicks.load(std::memory_order_relaxed);
+		return ticks * av_q2d(timeBase);
 	}
 
 	bool PacketQueue::isFlushPacket(AVPacket pkt) {
@@ -62,24 +235,160 @@ namespace jf {
 	};
 	static FFMpegInit ffmpegInit;
 	
-	Demuxer* Demuxer::open(const char* path) {
+	DecoderOptions::DecoderOptions()
+	:	threadCount(0)
+	,	threadType(FF_THREAD_FRAME|FF_THREAD_SLICE)
+	,	lowDelay(false)
+	,	maxWidth(0)
+	,	maxHeight(0)
+	{}
+	
+	DecoderOptions& DecoderOptions::setThreads(int count, int type) {
+		threadCount = count;
+		threadType = type;
+		return *this;
+	}
+	
+	DecoderOptions& DecoderOptions::setLowDelay(bool low) {
+		lowDelay = low;
+		return *this;
+	}
+	
+	DecoderOptions& DecoderOptions::setMaxSize(int w, int h) {
+		maxWidth = std::max(0, w);
+		maxHeight = std::max(0, h);
+		return *this;
+	}
+	
+	// raw h264 and some avis have no pts, ffmpeg's best guess or the dts will do
+	static int64_t frameTimestamp(AVFrame* frame) {
+		int64_t pts = frame->pkt_pts;
+		if(pts == AV_NOPTS_VALUE)
+			pts = av_frame_get_best_effort_timestamp(frame);
+		if(pts == AV_NOPTS_VALUE)
+			pts = frame->pkt_dts;
+		return pts;
+	}
+	
+	// biggest w x h with the source's aspect that fits in the box, never
+	// bigger than the source and even so 4:2:0 chroma divides evenly
+	static void fitSize(int srcWidth, int srcHeight, int boxWidth, int boxHeight, int* w, int* h) {
+		*w = srcWidth;
+		*h = srcHeight;
+		if(boxWidth <= 0 || boxHeight <= 0 || srcWidth <= 0 || srcHeight <= 0)
+			return;
+		
+		double scale = std::min(boxWidth / (double)srcWidth, boxHeight / (double)srcHeight);
+		if(scale >= 1.0)
+			return;
+		*w = std::max(2, (int)(srcWidth * scale + 0.5) & ~1);
+		*h = std::max(2, (int)(srcHeight * scale + 0.5) & ~1);
+	}
+	
+	StreamSelection::StreamSelection()
+	:	video(true)
+	,	audio(true)
+	,	videoIndex(-1)
+	,	audioIndex(-1)
+	{}
+	
+	StreamSelection& StreamSelection::setVideo(bool on) {
+		video = on;
+		return *this;
+	}
+	
+	StreamSelection& StreamSelection::setAudio(bool on) {
+		audio = on;
+		return *this;
+	}
+	
+	StreamSelection& StreamSelection::setVideoTrack(int idx) {
+		videoIndex = idx;
+		return *this;
+	}
+	
+	StreamSelection& StreamSelection::setAudioTrack(int idx) {
+		audioIndex = idx;
+		return *this;
+	}
+	
+	StreamSelection& StreamSelection::setVideoLanguage(const char* language) {
+		videoLanguage = language ? language : "";
+		return *this;
+	}
+	
+	StreamSelection& StreamSelection::setAudioLanguage(const char* language) {
+		audioLanguage = language ? language : "";
+		return *this;
+	}
+	
+	Demuxer* Demuxer::open(const char* path, int flags, const StreamSelection& selection) {
 		AVFormatContext* format = NULL;
+		SeekIndexFile* sidecar = NULL;
+		Demuxer* de = NULL;
 		
 		try {
 			// open the file
 			if(avformat_open_input(&format, path, NULL, NULL) < 0)
 				throw -1;
+			
+			de = new Demuxer();
+			de->path = path;
+			de->format = format;
+			
+			// a current sidecar already knows what probing would find out
+			if(flags & UseSeekIndex)
+				sidecar = SeekIndexFile::open(path);
+			if(sidecar && !de->applySeekIndex(sidecar)) {
+				delete sidecar;
+				sidecar = NULL;
+			}
+			
 			// read thru the header
-			if(avformat_find_stream_info(format, NULL) < 0) {
+			if(!sidecar && avformat_find_stream_info(format, NULL) < 0) {
 				throw -1;
 			}
 			
-			// make a demuxer, return it
-			Demuxer* de = new Demuxer();
-			de->format = format;
+			// make a demuxer, start it reading, return it
+			de->packetQueues.resize(format->nb_streams, NULL);
+			de->keyframeIndexes.resize(format->nb_streams, NULL);
+			de->parked.resize(format->nb_streams);
+			de->packetCounts.resize(format->nb_streams, 0);
+			for(int i=0; i<format->nb_streams; i++) {
+				if(format->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+					de->keyframeIndexes[i] = new KeyframeIndex();
+			}
+			if(sidecar) {
+				for(int i=0; i<format->nb_streams; i++) {
+					int count = 0;
+					const KeyframeIndex::Entry* entries = sidecar->getEntries(i, &count);
+					if(de->keyframeIndexes[i])
+						de->keyframeIndexes[i]->load(entries, count);
+				}
+				delete sidecar;
+				sidecar = NULL;
+			}
+			else if(flags & ScanKeyframes) {
+				de->scanKeyframes();
+				if((flags & WriteSeekIndex) && !de->writeSeekIndex(path))
+					printf("couldn't write %s\n", SeekIndexFile::getPath(path).c_str());
+			}
+			
+			// after the scan, which indexes every video stream for the sidecar
+			de->selectStreams(selection);
+			de->seekStream = de->videoStream;
+			
+			if(!(flags & Deferred))
+				de->start();
 			return de;
 		}
 		catch(...) {
+			delete sidecar;
+			if(de) {
+				// the demuxer closes the format for us
+				delete de;
+				format = NULL;
+			}
 			if(format) {
 				// something went wrong, clean up
 				avformat_close_input(&format);
@@ -92,16 +401,55 @@ namespace jf {
 	
 	Demuxer::Demuxer()
 	:	format(NULL)
-	{}
+	,	sleeping(false)
+	,	atEndOfFile(false)
+	,	quit(false)
+	,	parkedCount(0)
+	,	countingFrames(true)
+	,	seekStream(-1)
+	,	videoStream(-1)
+	,	audioStream(-1)
+	{
+		memset(&readStats, 0, sizeof(ReadStats));
+	}
 	
 	Demuxer::~Demuxer() {
+		if(demuxThread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(stateMutex);
+				quit = true;
+			}
+			wake.notify_all();
+			demuxThread.join();
+		}
+		
+		for(std::deque<AVPacket>& waiting : parked)
+			for(AVPacket& pkt : waiting)
+				av_free_packet(&pkt);
+		parked.clear();
+		
 		if(format) {
 			avformat_close_input(&format);
 			
-			for(auto st : packetQueues)
-				delete st.second;
+			for(PacketQueue* q : packetQueues)
+				delete q;
 			packetQueues.clear();
 		}
+		
+		for(KeyframeIndex* index : keyframeIndexes)
+			delete index;
+		keyframeIndexes.clear();
+		
+		if(readStats.bytesRead > 0)
+			printf("demuxer:\n\t%lld packets read, %lld used\n\t%lld bytes read, %lld used (%.1f%%)\n",
+				   readStats.packetsRead, readStats.packetsUsed, readStats.bytesRead, readStats.bytesUsed,
+				   readStats.bytesUsed * 100.0 / readStats.bytesRead);
+		if(readStats.packetsParked > 0)
+			printf("\t%lld packets parked while another stream caught up, %lld at most\n", readStats.packetsParked, readStats.mostParked);
+	}
+	
+	const char* Demuxer::getPath() {
+		return path.c_str();
 	}
 	
 	AVFormatContext* Demuxer::getFormat() {
@@ -115,16 +463,62 @@ namespace jf {
 	}
 	
 	int Demuxer::getStreamIndex(AVMediaType type) {
-		// look up the best-guess stream index for media type
+		if(type == AVMEDIA_TYPE_VIDEO)
+			return videoStream;
+		if(type == AVMEDIA_TYPE_AUDIO)
+			return audioStream;
+		return -1;
+	}
+	
+	int Demuxer::pickStream(AVMediaType type, int index, const std::string& language) {
+		if(index >= 0) {
+			if(index < format->nb_streams && format->streams[index]->codec->codec_type == type)
+				return index;
+			printf("stream %d isn't %s\n", index, av_get_media_type_string(type));
+		}
+		
+		if(!language.empty()) {
+			for(int i=0; i<format->nb_streams; i++) {
+				AVStream* st = format->streams[i];
+				AVDictionaryEntry* tag = av_dict_get(st->metadata, "language", NULL, 0);
+				if(st->codec->codec_type == type && tag && language == tag->value)
+					return i;
+			}
+			printf("no %s stream in %s\n", av_get_media_type_string(type), language.c_str());
+		}
+		
 		return av_find_best_stream(format, type, -1, -1, NULL, 0);
 	}
 	
-	PacketQueue* Demuxer::getPacketQueue(int idx) {
+	void Demuxer::selectStreams(const StreamSelection& selection) {
+		videoStream = selection.video ? pickStream(AVMEDIA_TYPE_VIDEO, selection.videoIndex, selection.videoLanguage) : -1;
+		audioStream = selection.audio ? pickStream(AVMEDIA_TYPE_AUDIO, selection.audioIndex, selection.audioLanguage) : -1;
+		
+		// the container skips these without handing us their packets
+		int discarded = 0;
+		for(int i=0; i<format->nb_streams; i++) {
+			if(i != videoStream && i != audioStream) {
+				format->streams[i]->discard = AVDISCARD_ALL;
+				discarded++;
+			}
+		}
+		printf("%s: video stream %d, audio stream %d, %d discarded\n", path.c_str(), videoStream, audioStream, discarded);
+	}
+	
+	Demuxer::ReadStats Demuxer::getReadStats() {
+		std::lock_guard<std::mutex> io(ioMutex);
+		return readStats;
+	}
+	
+	PacketQueue* Demuxer::getPacketQueue(int idx, const DecoderOptions& options) {
 		if(idx < 0 || idx >= format->nb_streams)
 			return NULL;
 		
+		// the demux thread reads the queue map while holding ioMutex
+		std::lock_guard<std::mutex> io(ioMutex);
+		
 		// check to see if we already made one
-		if(packetQueues.count(idx))
+		if(packetQueues[idx])
 			return packetQueues[idx];
 		
 		// guess not, get the stream
@@ -133,63 +527,460 @@ namespace jf {
 		AVCodecContext* ctx = st->codec;
 		// find the decoder
 		AVCodec* codec = avcodec_find_decoder(ctx->codec_id);
+		
+		// threading has to be decided before the codec opens
+		int threads = options.threadCount;
+		if(threads <= 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		ctx->thread_count = threads;
+		ctx->thread_type = options.threadType;
+		if(options.lowDelay) {
+			// frame threading holds back a frame per thread
+			ctx->thread_type &= ~FF_THREAD_FRAME;
+			ctx->flags |= CODEC_FLAG_LOW_DELAY;
+		}
+		
+		// so is lowres, halve for as long as the picture still fills the box
+		if(ctx->codec_type == AVMEDIA_TYPE_VIDEO && codec && codec->max_lowres > 0) {
+			int w, h, lowres = 0;
+			fitSize(ctx->width, ctx->height, options.maxWidth, options.maxHeight, &w, &h);
+			while(lowres < codec->max_lowres && (ctx->width >> (lowres + 1)) >= w && (ctx->height >> (lowres + 1)) >= h)
+				lowres++;
+			ctx->lowres = lowres;
+			if(lowres > 0)
+				printf("%s decoding at 1/%d size\n", codec->name, 1 << lowres);
+		}
+		
 		// initialize the decoder
 		if(avcodec_open2(ctx, codec, NULL) < 0)
 			return NULL;
 		
+		if(ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+			const char* type = (ctx->active_thread_type & FF_THREAD_FRAME) ? "frame" : (ctx->active_thread_type & FF_THREAD_SLICE) ? "slice" : "no";
+			printf("%s decoder: %d threads, %s threading\n", codec->name, ctx->thread_count, type);
+		}
+		
 		// go ahead and allocate some storage
 		ctx->opaque = (uint64_t*)av_malloc(sizeof(uint64_t));
 		
 		// make a new packet queue, store it, return it
-		PacketQueue* queue = new PacketQueue;
-		packetQueues[idx] = queue;
+		PacketQueue* queue = new PacketQueue(this, st->time_base);
+		{
+			std::lock_guard<std::mutex> lock(stateMutex);
+			packetQueues[idx] = queue;
+		}
+		wake.notify_all();
 		return queue;
 	}
-
-	void Demuxer::demux(int idx) {
-		if(idx < 0 || idx >= format->nb_streams)
+	
+	KeyframeIndex* Demuxer::getKeyframeIndex(int idx) {
+		if(idx < 0 || idx >= keyframeIndexes.size())
+			return NULL;
+		return keyframeIndexes[idx];
+	}
+	
+	void Demuxer::indexPacket(const AVPacket& packet) {
+		int idx = packet.stream_index;
+		KeyframeIndex* index = keyframeIndexes[idx];
+		if(!index)
 			return;
 		
-		// make sure we event care about this stream
-		if(packetQueues.count(idx)) {
-			AVPacket packet;
-			// pull packets until we find the stream we want
-			while(true) {
-				// get the next packet
-				if(av_read_frame(format, &packet) < 0)
-					return;
+		if((packet.flags & AV_PKT_FLAG_KEY) && packet.pts != AV_NOPTS_VALUE) {
+			KeyframeIndex::Entry e;
+			e.pts = packet.pts;
+			e.dts = (packet.dts != AV_NOPTS_VALUE) ? packet.dts : packet.pts;
+			e.pos = packet.pos;
+			e.frame = countingFrames ? packetCounts[idx] : -1;
+			index->add(e);
+		}
+		packetCounts[idx]++;
+	}
+	
+	void Demuxer::scanKeyframes() {
+		auto start = std::chrono::steady_clock::now();
+		
+		// only the indexed streams need their packets read in
+		std::vector<AVDiscard> discard(format->nb_streams);
+		for(int i=0; i<format->nb_streams; i++) {
+			discard[i] = format->streams[i]->discard;
+			if(!keyframeIndexes[i])
+				format->streams[i]->discard = AVDISCARD_ALL;
+		}
+		
+		AVPacket packet;
+		while(av_read_frame(format, &packet) >= 0) {
+			indexPacket(packet);
+			av_free_packet(&packet);
+		}
+		
+		int keyframes = 0;
+		for(int i=0; i<format->nb_streams; i++) {
+			format->streams[i]->discard = discard[i];
+			if(keyframeIndexes[i]) {
+				keyframeIndexes[i]->setComplete();
+				keyframeIndexes[i]->restart();
+				keyframes += keyframeIndexes[i]->getCount();
+				// plenty of containers don't say
+				if(format->streams[i]->nb_frames == 0)
+					format->streams[i]->nb_frames = packetCounts[i];
+			}
+			packetCounts[i] = 0;
+		}
+		
+		// back to the top for playback
+		int64_t begin = (format->start_time != AV_NOPTS_VALUE) ? format->start_time : 0;
+		avformat_seek_file(format, -1, INT64_MIN, begin, begin, 0);
+		
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("keyframe index:\n\t%d keyframes\n\t%f sec to scan\n", keyframes, elapsed);
+	}
+	
+	bool Demuxer::applySeekIndex(const SeekIndexFile* file) {
+		if(file->getStreamCount() != format->nb_streams)
+			return false;
+		
+		for(int i=0; i<format->nb_streams; i++) {
+			const SeekIndexFile::Stream* s = file->getStream(i);
+			AVCodecContext* ctx = format->streams[i]->codec;
+			if(s->codecType != ctx->codec_type || s->codecId != ctx->codec_id)
+				return false;
+		}
+		
+		for(int i=0; i<format->nb_streams; i++) {
+			const SeekIndexFile::Stream* s = file->getStream(i);
+			AVStream* st = format->streams[i];
+			AVCodecContext* ctx = st->codec;
+			
+			ctx->width = s->width;
+			ctx->height = s->height;
+			ctx->pix_fmt = (PixelFormat)s->pixelFormat;
+			ctx->colorspace = (AVColorSpace)s->colorSpace;
+			ctx->color_range = (AVColorRange)s->colorRange;
+			ctx->sample_fmt = (AVSampleFormat)s->sampleFormat;
+			ctx->sample_rate = s->sampleRate;
+			ctx->channels = s->channels;
+			ctx->channel_layout = s->channelLayout;
+			ctx->time_base.num = s->codecTimeBaseNum;
+			ctx->time_base.den = s->codecTimeBaseDen;
+			st->time_base.num = s->timeBaseNum;
+			st->time_base.den = s->timeBaseDen;
+			st->r_frame_rate.num = s->frameRateNum;
+			st->r_frame_rate.den = s->frameRateDen;
+			st->start_time = s->startTime;
+			st->duration = s->duration;
+			st->nb_frames = s->frameCount;
+		}
+		
+		format->start_time = file->getHeader()->startTime;
+		format->duration = file->getHeader()->duration;
+		return true;
+	}
+	
+	bool Demuxer::writeSeekIndex(const char* path) {
+		std::vector<SeekIndexFile::Stream> streams(format->nb_streams);
+		std::vector<std::vector<KeyframeIndex::Entry>> keyframes(format->nb_streams);
+		
+		for(int i=0; i<format->nb_streams; i++) {
+			AVStream* st = format->streams[i];
+			AVCodecContext* ctx = st->codec;
+			SeekIndexFile::Stream& s = streams[i];
+			memset(&s, 0, sizeof(s));
+			
+			s.codecType = ctx->codec_type;
+			s.codecId = ctx->codec_id;
+			s.width = ctx->width;
+			s.height = ctx->height;
+			s.pixelFormat = ctx->pix_fmt;
+			s.colorSpace = ctx->colorspace;
+			s.colorRange = ctx->color_range;
+			s.sampleFormat = ctx->sample_fmt;
+			s.sampleRate = ctx->sample_rate;
+			s.channels = ctx->channels;
+			s.channelLayout = ctx->channel_layout;
+			s.codecTimeBaseNum = ctx->time_base.num;
+			s.codecTimeBaseDen = ctx->time_base.den;
+			s.timeBaseNum = st->time_base.num;
+			s.timeBaseDen = st->time_base.den;
+			s.frameRateNum = st->r_frame_rate.num;
+			s.frameRateDen = st->r_frame_rate.den;
+			s.startTime = st->start_time;
+			s.duration = st->duration;
+			s.frameCount = st->nb_frames;
+			
+			if(keyframeIndexes[i])
+				keyframes[i] = keyframeIndexes[i]->getEntries();
+		}
+		
+		return SeekIndexFile::write(path, format->start_time, format->duration, streams, keyframes);
+	}
+	
+	void Demuxer::start() {
+		if(!demuxThread.joinable())
+			demuxThread = std::thread(&Demuxer::demux, this);
+	}
+	
+	void Demuxer::wakeUp() {
+		// consumers call this often, only pay for the lock if it's needed.
+		// pairs with the fence in demux(), either we see it asleep or it
+		// sees everything we popped before this
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(stateMutex);
+			wake.notify_all();
+		}
+	}
+	
+	bool Demuxer::wantsPackets() {
+		return canUnpark() || wantsToRead();
+	}
+	
+	bool Demuxer::wantsToRead() {
+		if(atEndOfFile)
+			return false;
+		
+		bool any = false, full = false, hungry = false, overflowing = false, backedUp = false;
+		for(PacketQueue* q : packetQueues) {
+			if(!q)
+				continue;
+			any = true;
+			full = full || q->isFull();
+			hungry = hungry || q->isHungry();
+			overflowing = overflowing || q->isOverflowing();
+			backedUp = backedUp || q->isBackedUp();
+		}
+		
+		// keep reading while nobody is full, or somebody is starving. a
+		// stream nobody's reading, like a paused player's audio, can't stop
+		// the rest for good, its packets get parked until it catches up
+		return any && (hungry || (!full && !overflowing && !backedUp));
+	}
+	
+	bool Demuxer::canUnpark() {
+		for(PacketQueue* q : packetQueues)
+			if(q && q->isBackedUp() && q->hasRoom() && !q->isOverflowing())
+				return true;
+		return false;
+	}
+	
+	void Demuxer::unpark() {
+		for(int i=0; i<(int)parked.size(); i++) {
+			std::deque<AVPacket>& waiting = parked[i];
+			PacketQueue* q = packetQueues[i];
+			while(!waiting.empty() && !q->isOverflowing() && q->push(waiting.front())) {
+				waiting.pop_front();
+				parkedCount--;
+			}
+			if(q && waiting.empty())
+				q->setBackedUp(false);
+		}
+	}
+
+	void Demuxer::demux() {
+		while(true) {
+			{
+				std::unique_lock<std::mutex> lock(stateMutex);
+				sleeping = true;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				wake.wait(lock, [this]() { return quit || wantsPackets(); });
+				sleeping = false;
 				
-				// check if its a stream we care about
-				if(packetQueues.count(packet.stream_index)) {
-					// store the packet
-					packetQueues[packet.stream_index]->push(packet);
-					// and return if it was the one we wanted
-					if(packet.stream_index == idx)
-						return;
+				if(quit) {
+					// release anybody still waiting on packets
+					for(PacketQueue* q : packetQueues)
+						if(q) q->setEndOfFile();
+					return;
 				}
-				else {
-					// otherwise clean up and move on
-					av_free_packet(&packet);
+			}
+			
+			std::lock_guard<std::mutex> io(ioMutex);
+			
+			// whatever was held back goes first, then maybe nothing else is wanted.
+			// seekToTime can't run in between, so atEndOfFile is safe to read
+			unpark();
+			if(!wantsToRead())
+				continue;
+			
+			// get the next packet
+			AVPacket packet;
+			if(av_read_frame(format, &packet) < 0) {
+				std::lock_guard<std::mutex> lock(stateMutex);
+				atEndOfFile = true;
+				for(PacketQueue* q : packetQueues)
+					if(q) q->setEndOfFile();
+				
+				// read straight through from the top, we've seen every keyframe
+				if(countingFrames)
+					for(KeyframeIndex* index : keyframeIndexes)
+						if(index) index->setComplete();
+				continue;
+			}
+			
+			indexPacket(packet);
+			readStats.packetsRead++;
+			readStats.bytesRead += packet.size;
+			
+			// check if its a stream we care about
+			PacketQueue* queue = packetQueues[packet.stream_index];
+			if(queue) {
+				readStats.packetsUsed++;
+				readStats.bytesUsed += packet.size;
+				
+				// store the packet, or park it behind the ones already waiting
+				// until there's room. a stream that's way over only gets read
+				// for because another is starving, so it waits too
+				std::deque<AVPacket>& waiting = parked[packet.stream_index];
+				if(!waiting.empty() || queue->isOverflowing() || !queue->push(packet)) {
+					// the next read can reuse whatever the packet points into
+					av_dup_packet(&packet);
+					waiting.push_back(packet);
+					queue->setBackedUp(true);
+					parkedCount++;
+					readStats.packetsParked++;
+					readStats.mostParked = std::max(readStats.mostParked, parkedCount);
 				}
 			}
+			else {
+				// otherwise clean up and move on
+				av_free_packet(&packet);
+			}
 		}
 	}
 	
 	void Demuxer::seekToTime(double time) {
-		int64_t ts = time * AV_TIME_BASE - AV_TIME_BASE;
+		std::lock_guard<std::mutex> io(ioMutex);
+		
+		bool seeked = false;
+		if(seekStream >= 0) {
+			AVStream* st = format->streams[seekStream];
+			int64_t target = llrint(time / av_q2d(st->time_base));
+			
+			// straight to the keyframe if we know it, otherwise the
+			// container's own index finds the last one at or before target
+			KeyframeIndex::Entry key;
+			if(keyframeIndexes[seekStream]->find(target, &key))
+				target = key.dts;
+			seeked = avformat_seek_file(format, seekStream, INT64_MIN, target, target, 0) >= 0;
+		}
+		if(!seeked) {
+			int64_t ts = time * AV_TIME_BASE;
+			avformat_seek_file(format, -1, INT64_MIN, ts, ts, 0);
+		}
+		
+		// the next keyframe read doesn't follow the last one, and we've lost count
+		for(KeyframeIndex* index : keyframeIndexes)
+			if(index) index->restart();
+		countingFrames = false;
 		
-		avformat_seek_file(format, -1, INT64_MIN, ts, ts, AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_FRAME);
+		for(std::deque<AVPacket>& waiting : parked) {
+			for(AVPacket& pkt : waiting)
+				av_free_packet(&pkt);
+			waiting.clear();
+		}
+		parkedCount = 0;
 
-		for(auto p : packetQueues)
-			p.second->flush();
+		for(PacketQueue* q : packetQueues) {
+			if(q) {
+				q->setBackedUp(false);
+				q->flush();
+			}
+		}
+		
+		std::lock_guard<std::mutex> lock(stateMutex);
+		atEndOfFile = false;
+		wake.notify_all();
 	}
 
+	BufferPool::BufferPool()
+	:	bufferSize(0)
+	,	maxIdle(0)
+	{
+		memset(&stats, 0, sizeof(Stats));
+	}
+	
+	BufferPool::Ptr BufferPool::create(int size, int n) {
+		BufferPool* pool = new BufferPool;
+		pool->bufferSize = size;
+		pool->maxIdle = n;
+		return Ptr(pool);
+	}
+	
+	BufferPool::~BufferPool() {
+		for(uint8_t* buf : idle)
+			free(buf);
+		idle.clear();
+	}
+	
+	uint8_t* BufferPool::acquire() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(!idle.empty()) {
+				uint8_t* buf = idle.back();
+				idle.pop_back();
+				stats.hits++;
+				return buf;
+			}
+			
+			stats.misses++;
+			stats.residentBytes += bufferSize;
+			stats.peakResidentBytes = std::max(stats.peakResidentBytes, stats.residentBytes);
+		}
+		
+		void* buf = NULL;
+		if(posix_memalign(&buf, Alignment, bufferSize) != 0)
+			return NULL;
+		return (uint8_t*)buf;
+	}
+	
+	void BufferPool::release(uint8_t* buf) {
+		if(!buf)
+			return;
+		
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(idle.size() < maxIdle) {
+				idle.push_back(buf);
+				return;
+			}
+			stats.residentBytes -= bufferSize;
+		}
+		
+		// already holding as many as we're allowed
+		free(buf);
+	}
+	
+	void BufferPool::setMaxIdle(int n) {
+		std::lock_guard<std::mutex> lock(mutex);
+		maxIdle = n;
+		while(idle.size() > maxIdle) {
+			free(idle.back());
+			idle.pop_back();
+			stats.residentBytes -= bufferSize;
+		}
+	}
+	
+	int BufferPool::getBufferSize() const { return bufferSize; }
+	
+	BufferPool::Stats BufferPool::getStats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+	FrameTarget::~FrameTarget() {
+	}
+	
 	VideoFrame::VideoFrame()
-	:	outTime(0.0)
+	:	format(PIX_FMT_RGB24)
+	,	numPlanes(1)
+	,	colorSpace(AVCOL_SPC_UNSPECIFIED)
+	,	fullRange(false)
+	,	outTime(0.0)
+	,	nextTime(0.0)
+	,	pts(0)
 	,	width(0)
 	,	height(0)
 	,	numBytes(0)
 	,	bytes(NULL)
+	,	targetId(-1)
 	{}
 	
 	VideoFrame::~VideoFrame() {
@@ -204,14 +995,62 @@ namespace jf {
 		fr->height = h;
 		fr->numBytes = sz;
 		fr->bytes = new uint8_t[sz];
+		fr->planeOffsets[0] = 0;
+		fr->planeWidths[0] = w;
+		fr->planeHeights[0] = h;
 		if(ptr) {
 			memcpy(fr->bytes, ptr, sz);
 		}
 		return Ptr(fr);
 	}
 	
+	VideoFrame::Ptr VideoFrame::create(BufferPool::Ptr pool, double o, int w, int h) {
+		uint8_t* bytes = pool->acquire();
+		if(!bytes)
+			return Ptr();
+		
+		VideoFrame* fr = new VideoFrame;
+		fr->outTime = o;
+		fr->width = w;
+		fr->height = h;
+		fr->numBytes = pool->getBufferSize();
+		fr->bytes = bytes;
+		fr->planeOffsets[0] = 0;
+		fr->planeWidths[0] = w;
+		fr->planeHeights[0] = h;
+		return Ptr(fr, [pool](VideoFrame* f) {
+			pool->release(f->bytes);
+			f->bytes = NULL;
+			delete f;
+		});
+	}
+	
+	VideoFrame::Ptr VideoFrame::create(FrameTarget* target, double o, int w, int h, int sz) {
+		uint8_t* bytes = NULL;
+		int id = target->acquire(sz, &bytes);
+		if(id < 0)
+			return Ptr();
+		
+		VideoFrame* fr = new VideoFrame;
+		fr->outTime = o;
+		fr->width = w;
+		fr->height = h;
+		fr->numBytes = sz;
+		fr->bytes = bytes;
+		fr->targetId = id;
+		fr->planeOffsets[0] = 0;
+		fr->planeWidths[0] = w;
+		fr->planeHeights[0] = h;
+		return Ptr(fr, [target](VideoFrame* f) {
+			target->release(f->targetId);
+			f->bytes = NULL;
+			delete f;
+		});
+	}
+	
 	AudioBuffer::AudioBuffer()
 	:	outTime(0.0)
+	,	tempo(1.f)
 	,	sampleRate(0)
 	,	numBytes(0)
 	,	bytes(NULL)
@@ -234,6 +1073,23 @@ namespace jf {
 		return Ptr(buf);
 	}
 	
+	AudioBuffer::Ptr AudioBuffer::create(BufferPool::Ptr pool, double o, int sr) {
+		uint8_t* bytes = pool->acquire();
+		if(!bytes)
+			return Ptr();
+		
+		AudioBuffer* buf = new AudioBuffer;
+		buf->outTime = o;
+		buf->sampleRate = sr;
+		buf->numBytes = pool->getBufferSize();
+		buf->bytes = bytes;
+		return Ptr(buf, [pool](AudioBuffer* b) {
+			pool->release(b->bytes);
+			b->bytes = NULL;
+			delete b;
+		});
+	}
+	
 
 	// this crap is to help ffmpeg assure good packet ordering
 	// but i think it isn't necessary anymore because now ffmpeg
@@ -266,7 +1122,7 @@ namespace jf {
 //		avcodec_default_release_buffer(c, pic);
 //	}
 
-	VideoDecoder* VideoDecoder::open(Demuxer* de) {
+	VideoDecoder* VideoDecoder::open(Demuxer* de, const DecoderOptions& options) {
 		if(!de)
 			return NULL;
 		
@@ -276,12 +1132,17 @@ namespace jf {
 		
 		VideoDecoder* dec = new VideoDecoder();
 		dec->demuxer = de;
-		dec->packets = de->getPacketQueue(st);
+		dec->packets = de->getPacketQueue(st, options);
+		if(!dec->packets) {
+			delete dec;
+			return NULL;
+		}
+		
 		dec->streamIdx = st;
 		dec->stream = de->getStream(st);
 		dec->context = dec->stream->codec;
 		dec->frame = avcodec_alloc_frame();
-		dec->frameRGB = avcodec_alloc_frame();
+		dec->frameOut = avcodec_alloc_frame();
 
 		int64_t numFrames = dec->stream->nb_frames;
 		double frameRate = av_q2d(dec->stream->r_frame_rate);
@@ -293,87 +1154,459 @@ namespace jf {
 //		dec->context->get_buffer = mp_create_video_buffer;
 //		dec->context->release_buffer = mp_release_video_buffer;
 		
-		dec->width = dec->context->width;
-		dec->height = dec->context->height;
-		dec->bytesPerFrame = avpicture_get_size(PIX_FMT_RGB24, dec->width, dec->height);
-		
-		dec->sws = sws_getCachedContext(dec->sws,
-										dec->width,
-										dec->height,
-										dec->context->pix_fmt,
-										dec->width,
-										dec->height,
-										PIX_FMT_RGB24,
-										SWS_BILINEAR,
-										NULL,
-										NULL,
-										NULL);
+		dec->configureOutput();
 
 		return dec;
 	}
 	
+	void VideoDecoder::configureOutput() {
+		PixelFormat native = context->pix_fmt;
+		// lowres has already made the codec's size smaller
+		fitSize(context->width, context->height, maxWidth, maxHeight, &width, &height);
+		bool scaled = width != context->width || height != context->height;
+		
+		switch(outputFormat) {
+			case OutputYUV: outPixFmt = (native == PIX_FMT_NV12) ? PIX_FMT_NV12 : PIX_FMT_YUV420P; break;
+			case OutputRGBA: outPixFmt = PIX_FMT_RGBA; break;
+			case OutputBGRA: outPixFmt = PIX_FMT_BGRA; break;
+			default: outPixFmt = PIX_FMT_RGB24; break;
+		}
+		
+		bytesPerFrame = avpicture_get_size(outPixFmt, width, height);
+		// frames still out there keep the old pool alive until they come back
+		framePool = BufferPool::create(bytesPerFrame, aheadDepth + 2);
+		
+		// full range 4:2:0 is laid out the same, the renderer handles the range
+		bool passThrough = !scaled && ((native == outPixFmt) || (native == PIX_FMT_YUVJ420P && outPixFmt == PIX_FMT_YUV420P));
+		
+		delete converter;
+		converter = NULL;
+		
+		if(!passThrough) {
+			// simd kernels for yuv to rgb, swscale for scaling and everything else
+			bool fullRange = context->color_range == AVCOL_RANGE_JPEG;
+			converter = ColorConverter::create(native, outPixFmt, context->width, context->height, width, height, context->colorspace, fullRange);
+			if(converter)
+				printf("video conversion: %s, %dx%d to %dx%d\n", ColorConverter::getKernelName(converter->getKernel()),
+					   context->width, context->height, width, height);
+		}
+	}
+	
 	VideoDecoder::VideoDecoder()
 	:	streamIdx(-1)
 	,	context(NULL)
 	,	frame(NULL)
-	,	frameRGB(NULL)
-	,	sws(NULL)
+	,	frameOut(NULL)
+	,	converter(NULL)
+	,	frameTarget(NULL)
+	,	outputFormat(OutputRGB)
+	,	outPixFmt(PIX_FMT_RGB24)
+	,	convertSlices(0)
+	,	skipLevel(AVDISCARD_DEFAULT)
 	,	width(0)
 	,	height(0)
 	,	bytesPerFrame(0)
+	,	maxWidth(0)
+	,	maxHeight(0)
 	,	clock(0.0)
 	,	nextFrameTime(0.0)
 	,	currentFrame(0)
 	,	lastFrame(false)
+	,	lateTime(-1.0)
+	,	lateRun(0)
+	,	decodeStats()
+	,	seekTarget(-1.0)
+	,	seekFrom(0.0)
+	,	seekBackoff(1.0)
+	,	decodedEnd(0.0)
+	,	seekLanded(true)
+	,	seekExact(true)
+	,	gopCache(NULL)
+	,	gopCacheBudget(256 * 1024 * 1024)
+	,	needsResync(false)
+	,	resyncTime(0.0)
+	,	reverse(false)
+	,	reverseStalled(false)
+	,	stallTime(0.0)
+	,	seekPending(false)
+	,	seekPendingExact(false)
+	,	seekUnshown(false)
+	,	seekPendingTime(0.0)
+	,	seekSerial(0)
+	,	scrubbing(false)
+	,	scrubTarget(0.0)
+	,	scrubSettleDelay(0.15)
+	,	aheadDepth(0)
+	,	quitAhead(false)
 	{}
 	
 	VideoDecoder::~VideoDecoder() {
+		// the worker could be waiting on packets that are never coming
+		if(aheadThread.joinable())
+			packets->setEndOfFile();
+		stopDecodeAhead();
+		delete gopCache;
+		
+		BufferPool::Stats st = framePool->getStats();
+		printf("video frame pool:\n\t%lld hits\n\t%lld misses\n\t%lld peak bytes\n", st.hits, st.misses, st.peakResidentBytes);
+		if(decodeStats.seeks > 0)
+			printf("video seeking:\n\t%lld seeks\n\t%lld superseded\n\t%f ms to first frame\n", decodeStats.seeks, decodeStats.seeksSuperseded, decodeStats.seekLatency * 1000.0 / decodeStats.seeks);
+		if(decodeStats.scrubs > 0)
+			printf("video scrubbing:\n\t%lld steps\n\t%f ms/step\n", decodeStats.scrubs, decodeStats.scrubTime * 1000.0 / decodeStats.scrubs);
+		if(decodeStats.frames > 0)
+			printf("video decoding:\n\t%lld frames\n\t%f frames/sec\n\t%f ms decode/frame\n\t%f ms convert/frame\n",
+				   decodeStats.frames, decodeStats.frames / decodeStats.decodeTime,
+				   decodeStats.decodeTime * 1000.0 / decodeStats.frames, decodeStats.convertTime * 1000.0 / decodeStats.frames);
+		// what each frame on screen really cost, counting the ones decoded and never shown
+		if(decodeStats.shown > 0)
+			printf("\t%lld frames shown\n\t%f ms decode+convert/frame shown\n",
+				   decodeStats.shown, (decodeStats.decodeTime + decodeStats.convertTime) * 1000.0 / decodeStats.shown);
+		if(decodeStats.dropped > 0 || decodeStats.overtaken > 0)
+			printf("\t%lld late frames dropped before converting\n\t%lld overtaken after\n", decodeStats.dropped, decodeStats.overtaken);
+		if(decodeStats.targeted > 0)
+			printf("\t%lld frames converted into upload memory\n", decodeStats.targeted);
+		
 		av_free(frame);
-		av_free(frameRGB);
-		sws_freeContext(sws);
+		av_free(frameOut);
+		delete converter;
 	}
 
 	int VideoDecoder::getWidth() { return width; }
 	int VideoDecoder::getHeight() { return height; }
 	int VideoDecoder::getBytesPerFrame() { return bytesPerFrame; }
-	bool VideoDecoder::isLastFrame() { return lastFrame; }
+	BufferPool::Stats VideoDecoder::getFramePoolStats() { return framePool->getStats(); }
+	
+	VideoDecoder::DecodeStats VideoDecoder::getDecodeStats() {
+		std::lock_guard<std::mutex> lock(queueMutex);
+		return decodeStats;
+	}
+	
+	void VideoDecoder::setOutputFormat(OutputFormat fmt) {
+		std::lock_guard<std::mutex> decoding(decodeMutex);
+		if(fmt == outputFormat)
+			return;
+		
+		outputFormat = fmt;
+		configureOutput();
+		
+		// cached frames are in the old format
+		delete gopCache;
+		gopCache = NULL;
+		reverse = false;
+		
+		std::lock_guard<std::mutex> lock(queueMutex);
+		frames.clear();
+		queueChanged.notify_all();
+	}
+	
+	VideoDecoder::OutputFormat VideoDecoder::getOutputFormat() { return outputFormat; }
+	
+	void VideoDecoder::setFrameTarget(FrameTarget* target) {
+		std::lock_guard<std::mutex> decoding(decodeMutex);
+		if(target == frameTarget)
+			return;
+		frameTarget = target;
+		
+		// let go of the old target's memory
+		std::lock_guard<std::mutex> lock(queueMutex);
+		frames.clear();
+		queueChanged.notify_all();
+	}
+	
+	void VideoDecoder::setOutputSize(int w, int h) {
+		std::lock_guard<std::mutex> decoding(decodeMutex);
+		int oldWidth = width, oldHeight = height;
+		maxWidth = std::max(0, w);
+		maxHeight = std::max(0, h);
+		
+		int fitWidth, fitHeight;
+		fitSize(context->width, context->height, maxWidth, maxHeight, &fitWidth, &fitHeight);
+		if(fitWidth == oldWidth && fitHeight == oldHeight)
+			return;
+		configureOutput();
+		
+		// cached frames are the old size
+		delete gopCache;
+		gopCache = NULL;
+		reverse = false;
+		
+		std::lock_guard<std::mutex> lock(queueMutex);
+		frames.clear();
+		queueChanged.notify_all();
+	}
+	bool VideoDecoder::isLastFrame() {
+		if(!lastFrame)
+			return false;
+		
+		// decode-ahead hits the end before we've shown everything
+		std::lock_guard<std::mutex> lock(queueMutex);
+		return frames.empty();
+	}
 
 	VideoFrame::Ptr VideoDecoder::previousFrame() {
-		int64_t pts = (currentFrame - 1);
+		if(gopCacheBudget > 0 && !gopCache)
+			gopCache = GopCache::open(demuxer->getPath(), streamIdx, outputFormat, maxWidth, maxHeight, convertSlices, gopCacheBudget);
+		
+		if(gopCache) {
+			VideoFrame::Ptr rez = gopCache->frameBefore(clock);
+			if(rez) {
+				present(rez);
+				needsResync = true;
+				resyncTime = rez->nextTime;
+				return rez;
+			}
+		}
+		
+		// seeks are exact, so one tick back is the frame before this one
+		seekToFrame(currentFrame - 1);
+		return nextFrame();
+	}
+	
+	VideoFrame::Ptr VideoDecoder::nextFrame() {
+		// stepping on from a scrub, no point waiting for it to settle
+		if(scrubbing) {
+			scrubMoved = std::chrono::steady_clock::time_point();
+			VideoFrame::Ptr rez = refineScrub();
+			if(rez)
+				return rez;
+		}
 		
-		seekToFrame(pts);
+		if(needsResync) {
+			// stepping forward again through what was cached
+			VideoFrame::Ptr rez = gopCache ? gopCache->frameAfter(clock) : VideoFrame::Ptr();
+			if(rez) {
+				present(rez);
+				resyncTime = rez->nextTime;
+				return rez;
+			}
+			resync();
+		}
 		
-		while(true) {
-			VideoFrame::Ptr frame = nextFrame();
-			if(!frame)
-				break;
+		VideoFrame::Ptr rez;
+		
+		if(aheadDepth > 0) {
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueChanged.wait(lock, [this]() { return !frames.empty() || lastFrame; });
 			
-			if(currentFrame > pts) {
-				break;
+			if(!frames.empty()) {
+				rez = frames.front();
+				frames.pop_front();
+				queueChanged.notify_all();
+			}
+		}
+		else {
+			applySeek();
+			rez = decodeFrame();
+		}
+		
+		present(rez);
+		return rez;
+	}
+	
+	void VideoDecoder::setReverse(bool r) {
+		if(r == reverse)
+			return;
+		
+		if(r && gopCacheBudget > 0 && !gopCache)
+			gopCache = GopCache::open(demuxer->getPath(), streamIdx, outputFormat, maxWidth, maxHeight, convertSlices, gopCacheBudget);
+		if(gopCache)
+			gopCache->setReverse(r);
+		
+		reverse = r && gopCache;
+		reverseStalled = false;
+		
+		// pick up going forwards right after whatever was showing
+		if(!reverse) {
+			needsResync = true;
+			resyncTime = nextFrameTime;
+		}
+	}
+	
+	bool VideoDecoder::isReverse() { return reverse; }
+	
+	VideoFrame::Ptr VideoDecoder::reverseFrameForTime(double time) {
+		if(!reverse || (time >= clock && time < nextFrameTime))
+			return VideoFrame::Ptr();
+		
+		VideoFrame::Ptr rez = gopCache->frameAt(time);
+		if(!rez) {
+			// once per stall is plenty
+			if(!reverseStalled) {
+				printf("reverse playback fell behind at %f\n", time);
+				reverseStalled = true;
+				stallTime = time;
 			}
+			return rez;
+		}
+		
+		if(reverseStalled) {
+			printf("reverse playback caught up, %f sec of movie late\n", stallTime - time);
+			reverseStalled = false;
+		}
+		
+		present(rez);
+		return rez;
+	}
+	
+	VideoFrame::Ptr VideoDecoder::scrubToTime(double time) {
+		auto start = std::chrono::steady_clock::now();
+		needsResync = false;
+		lateTime = -1.0;
+		
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			scrubbing = true;
+			// a scrub replaces any seek still on its way
+			seekPending = false;
+			seekUnshown = false;
+			seekSerial++;
+			frames.clear();
+		}
+		
+		VideoFrame::Ptr rez;
+		{
+			std::lock_guard<std::mutex> decoding(decodeMutex);
+			demuxer->seekToTime(time);
 			
-			if(currentFrame == pts) {
-				return frame;
+			seekTarget = std::max(0.0, time);
+			seekFrom = time;
+			seekBackoff = 1.0;
+			seekLanded = false;
+			seekExact = false;
+			decodedEnd = seekTarget;
+			
+			// the keyframe is all we want, the decoder skips everything after it
+			context->skip_frame = AVDISCARD_NONKEY;
+			rez = decodeFrame();
+			context->skip_frame = skipLevel;
+			
+			std::lock_guard<std::mutex> lock(queueMutex);
+			decodeStats.scrubs++;
+			decodeStats.scrubTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		
+		scrubTarget = time;
+		scrubMoved = std::chrono::steady_clock::now();
+		present(rez);
+		return rez;
+	}
+	
+	VideoFrame::Ptr VideoDecoder::refineScrub() {
+		if(!scrubbing)
+			return VideoFrame::Ptr();
+		
+		double still = std::chrono::duration<double>(std::chrono::steady_clock::now() - scrubMoved).count();
+		if(still < scrubSettleDelay)
+			return VideoFrame::Ptr();
+		
+		// landed right on the keyframe, just pick up after it
+		if(scrubTarget >= clock && scrubTarget < nextFrameTime) {
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				scrubbing = false;
 			}
+			needsResync = true;
+			resyncTime = nextFrameTime;
+			return VideoFrame::Ptr();
 		}
 		
-		return VideoFrame::Ptr();
+		seekToTime(scrubTarget);
+		return nextFrame();
 	}
 	
-	VideoFrame::Ptr VideoDecoder::nextFrame() {
+	bool VideoDecoder::isScrubbing() { return scrubbing; }
+	void VideoDecoder::setScrubSettleDelay(double sec) { scrubSettleDelay = sec; }
+	
+	void VideoDecoder::resync() {
+		seekToTime(resyncTime);
+		
+		// carrying on from a cached frame, not a seek anyone's waiting to see
+		std::lock_guard<std::mutex> lock(queueMutex);
+		seekUnshown = false;
+	}
+	
+	VideoFrame::Ptr VideoDecoder::frameForTime(double time) {
+		if(scrubbing)
+			return refineScrub();
+		
+		if(needsResync)
+			resync();
+		
+		// the first frame after a seek goes up as soon as it's ready
+		if(aheadDepth == 0)
+			return (time >= nextFrameTime || seekUnshown) ? nextFrame() : VideoFrame::Ptr();
+		
+		// skip past anything that's already late, keep the newest due frame
+		VideoFrame::Ptr due;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			if(seekUnshown && !frames.empty()) {
+				due = frames.front();
+				frames.pop_front();
+			}
+			while(!frames.empty() && frames.front()->outTime <= time) {
+				if(due)
+					decodeStats.overtaken++;
+				due = frames.front();
+				frames.pop_front();
+			}
+			if(due)
+				queueChanged.notify_all();
+		}
+		
+		present(due);
+		return due;
+	}
+	
+	void VideoDecoder::present(VideoFrame::Ptr rez) {
+		if(!rez)
+			return;
+		
+		currentFrame = rez->pts;
+		clock = rez->outTime;
+		nextFrameTime = rez->nextTime;
+		
+		std::lock_guard<std::mutex> lock(queueMutex);
+		if(seekUnshown) {
+			decodeStats.seeks++;
+			decodeStats.seekLatency += std::chrono::duration<double>(std::chrono::steady_clock::now() - seekRequested).count();
+			seekUnshown = false;
+		}
+		decodeStats.shown++;
+	}
+	
+	VideoFrame::Ptr VideoDecoder::decodeFrame() {
+		// the worker counts its own, then adds them in under queueMutex like
+		// the render thread's
+		DecodeStats tally = DecodeStats();
+		VideoFrame::Ptr rez = decodeFrame(tally);
+		
+		std::lock_guard<std::mutex> lock(queueMutex);
+		decodeStats.frames += tally.frames;
+		decodeStats.decodeTime += tally.decodeTime;
+		decodeStats.convertTime += tally.convertTime;
+		decodeStats.dropped += tally.dropped;
+		decodeStats.targeted += tally.targeted;
+		return rez;
+	}
+	
+	VideoFrame::Ptr VideoDecoder::decodeFrame(DecodeStats& tally) {
 		AVPacket packet;
+		int serial = seekSerial;
 		
 		// keep decoding until we have a whole frame
 		while(true) {
-			if(packets->isEmpty()) {
-				// fetch more packets
-				demuxer->demux(streamIdx);
-			}
+			// a newer seek wants the decoder, this one's wasted effort
+			if(serial != seekSerial)
+				return VideoFrame::Ptr();
 			
+			bool draining = false;
 			if(!packets->pop(&packet)) {
-				// i guess we're out of packets
-				lastFrame = true;
-				break;
+				// out of packets, but threaded decoders are still holding frames
+				av_init_packet(&packet);
+				packet.data = NULL;
+				packet.size = 0;
+				draining = true;
 			}
 			
 			if(PacketQueue::isFlushPacket(packet)) {
@@ -384,27 +1617,93 @@ namespace jf {
 			// decode next packet of video
 			int complete = 0;
 			int error = 0;
+			auto start = std::chrono::steady_clock::now();
 			if((error = avcodec_decode_video2(context, frame, &complete, &packet)) < 0) {
 				printf("ffmpeg video decoding error: %x\n", error);
 			}
+			tally.decodeTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 			// free allocated packet resources
 			av_free_packet(&packet);
 
+			if(draining && !complete) {
+				// i guess we're out of frames, unless a seek has moved us since
+				if(serial == seekSerial)
+					lastFrame = true;
+				break;
+			}
+			
 			// we decoded a whole frame
 			if(complete) {
-				currentDts = packet.dts;
-				currentFrame = frame->pkt_pts;
+				tally.frames++;
 				currentDts = frame->pkt_dts;
-				clock = currentFrame * av_q2d(stream->time_base);
+				int64_t pts = frameTimestamp(frame);
 				
+				// codecs like h264 count fields, ticks_per_frame makes it a whole frame
 				double delay = 0.0;
-				delay = av_q2d(context->time_base);
+				delay = av_q2d(context->time_base) * context->ticks_per_frame;
 				delay += frame->repeat_pict * (delay * 0.5);
-				nextFrameTime = clock + delay;
 				
-				VideoFrame::Ptr rez = VideoFrame::create(clock, width, height, bytesPerFrame, NULL);
-				avpicture_fill((AVPicture*)frameRGB, rez->bytes, PIX_FMT_RGB24, width, height);
-				sws_scale(sws, (uint8_t const* const*)frame->data, frame->linesize, 0, height, frameRGB->data, frameRGB->linesize);
+				// nothing to go on at all, carry on from the last one
+				double out = (pts != AV_NOPTS_VALUE) ? pts * av_q2d(stream->time_base) : decodedEnd;
+				decodedEnd = out + delay;
+				
+				if(seekTarget >= 0.0 && pts != AV_NOPTS_VALUE) {
+					if(!seekLanded && out > seekTarget && seekFrom > 0.0) {
+						// the demuxer overshot, back up further and try again
+						seekFrom = std::max(0.0, seekTarget - seekBackoff);
+						seekBackoff *= 2.0;
+						demuxer->seekToTime(seekFrom);
+						continue;
+					}
+					seekLanded = true;
+					
+					// not there yet, don't bother converting
+					if(seekExact && out + delay <= seekTarget)
+						continue;
+					seekTarget = -1.0;
+				}
+				
+				// the clock's already past this one, skip converting it
+				if(out + delay <= lateTime && !seekUnshown && lateRun < MaxLateRun) {
+					tally.dropped++;
+					lateRun++;
+					continue;
+				}
+				lateRun = 0;
+				
+				// straight into upload memory if there's any free
+				VideoFrame::Ptr rez;
+				if(frameTarget && (rez = VideoFrame::create(frameTarget, out, width, height, bytesPerFrame)))
+					tally.targeted++;
+				else
+					rez = VideoFrame::create(framePool, out, width, height);
+				if(!rez)
+					return rez;
+				rez->pts = (pts != AV_NOPTS_VALUE) ? pts : llrint(out / av_q2d(stream->time_base));
+				rez->nextTime = out + delay;
+				
+				start = std::chrono::steady_clock::now();
+				avpicture_fill((AVPicture*)frameOut, rez->bytes, outPixFmt, width, height);
+				if(converter) {
+					int slices = convertSlices > 0 ? convertSlices : WorkerPool::shared().getThreadCount() + 1;
+					converter->convertSliced((uint8_t const* const*)frame->data, frame->linesize, frameOut->data, frameOut->linesize, slices);
+				}
+				else
+					av_picture_copy((AVPicture*)frameOut, (AVPicture*)frame, outPixFmt, width, height);
+				tally.convertTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				
+				// describe the planes so the renderer can upload them separately
+				int chromaWidth = (width + 1) / 2;
+				int chromaHeight = (height + 1) / 2;
+				rez->format = outPixFmt;
+				rez->numPlanes = (outPixFmt == PIX_FMT_YUV420P) ? 3 : (outPixFmt == PIX_FMT_NV12) ? 2 : 1;
+				for(int i=0; i<rez->numPlanes; i++) {
+					rez->planeOffsets[i] = (int)(frameOut->data[i] - rez->bytes);
+					rez->planeWidths[i] = (i == 0) ? width : chromaWidth;
+					rez->planeHeights[i] = (i == 0) ? height : chromaHeight;
+				}
+				rez->colorSpace = context->colorspace;
+				rez->fullRange = context->color_range == AVCOL_RANGE_JPEG || context->pix_fmt == PIX_FMT_YUVJ420P;
 				return rez;
 			}
 		}
@@ -412,15 +1711,145 @@ namespace jf {
 		return VideoFrame::Ptr();
 	}
 	
+	void VideoDecoder::setDecodeAhead(int n) {
+		stopDecodeAhead();
+		
+		aheadDepth = std::max(0, n);
+		// the queue, the frame on screen and the one being decoded
+		framePool->setMaxIdle(aheadDepth + 2);
+		if(aheadDepth > 0) {
+			quitAhead = false;
+			aheadThread = std::thread(&VideoDecoder::decodeAhead, this);
+		}
+	}
+	
+	int VideoDecoder::getDecodeAhead() { return aheadDepth; }
+	
+	void VideoDecoder::setPlaybackRate(double rate) {
+		// b-frames are usually at least every other frame, keyframes a second or two apart
+		AVDiscard level = AVDISCARD_DEFAULT;
+		if(rate > 4.0)
+			level = AVDISCARD_NONKEY;
+		else if(rate > 2.0)
+			level = AVDISCARD_NONREF;
+		
+		std::lock_guard<std::mutex> decoding(decodeMutex);
+		if(level == skipLevel)
+			return;
+		skipLevel = level;
+		context->skip_frame = level;
+		printf("video skip level %s at %.2fx\n", level == AVDISCARD_NONKEY ? "keyframes only" : level == AVDISCARD_NONREF ? "reference frames" : "all frames", rate);
+	}
+	
+	AVDiscard VideoDecoder::getSkipLevel() { return skipLevel; }
+	
+	void VideoDecoder::setLateTime(double time) { lateTime = time; }
+	
+	void VideoDecoder::setConvertSlices(int n) {
+		std::lock_guard<std::mutex> decoding(decodeMutex);
+		convertSlices = std::max(0, n);
+	}
+	
+	int VideoDecoder::getConvertSlices() { return convertSlices; }
+	
+	void VideoDecoder::setGopCacheBudget(int64_t bytes) {
+		gopCacheBudget = std::max<int64_t>(0, bytes);
+		delete gopCache;
+		gopCache = NULL;
+		reverse = false;
+	}
+	
+	int64_t VideoDecoder::getGopCacheBudget() { return gopCacheBudget; }
+	
+	void VideoDecoder::stopDecodeAhead() {
+		if(aheadThread.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(queueMutex);
+				quitAhead = true;
+			}
+			queueChanged.notify_all();
+			aheadThread.join();
+			
+			std::lock_guard<std::mutex> lock(queueMutex);
+			frames.clear();
+		}
+		aheadDepth = 0;
+	}
+	
+	void VideoDecoder::decodeAhead() {
+		while(true) {
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueChanged.wait(lock, [this]() {
+					return quitAhead || seekPending || (frames.size() < aheadDepth && !lastFrame && !scrubbing);
+				});
+				if(quitAhead)
+					return;
+			}
+			
+			std::lock_guard<std::mutex> decoding(decodeMutex);
+			int serial = seekSerial;
+			applySeek();
+			VideoFrame::Ptr rez = decodeFrame();
+			
+			// anything from before the latest seek is stale
+			std::lock_guard<std::mutex> lock(queueMutex);
+			if(rez && serial == seekSerial)
+				frames.push_back(rez);
+			queueChanged.notify_all();
+		}
+	}
+	
 	int64_t VideoDecoder::getCurrentFrame() { return currentFrame; }
 	double VideoDecoder::getCurrentTime() { return clock; }
 	double VideoDecoder::getNextTime() { return nextFrameTime; }
 
-	void VideoDecoder::seekToFrame(int64_t frame) { demuxer->seekToTime(frame * av_q2d(stream->time_base)); }
+	void VideoDecoder::seekToFrame(int64_t frame) { seekToTime(frame * av_q2d(stream->time_base)); }
 	
-	void VideoDecoder::seekToTime(double time) {
-		demuxer->seekToTime(time);
+	void VideoDecoder::seekToTime(double time, bool exact) {
+		// the old time would count everything before it as late
+		lateTime = -1.0;
+		
+		std::lock_guard<std::mutex> lock(queueMutex);
+		needsResync = false;
+		// the last one never made it on screen
+		if(seekUnshown)
+			decodeStats.seeksSuperseded++;
+		seekPending = true;
+		seekPendingTime = time;
+		seekPendingExact = exact;
+		seekUnshown = true;
+		seekRequested = std::chrono::steady_clock::now();
+		seekSerial++;
+		
+		// throw out anything decoded from before the seek
+		frames.clear();
 		lastFrame = false;
+		scrubbing = false;
+		queueChanged.notify_all();
+	}
+	
+	bool VideoDecoder::isSeeking() { return seekUnshown; }
+	
+	void VideoDecoder::applySeek() {
+		double time;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			if(!seekPending)
+				return;
+			seekPending = false;
+			time = seekPendingTime;
+			seekExact = seekPendingExact;
+		}
+		
+		demuxer->seekToTime(time);
+		
+		// decode forward from the keyframe to the frame showing at time
+		seekTarget = std::max(0.0, time);
+		decodedEnd = seekTarget;
+		seekFrom = time;
+		seekBackoff = 1.0;
+		seekLanded = false;
 	}
 
 	AudioDecoder::AudioDecoder()
@@ -433,6 +1862,14 @@ namespace jf {
 	,	channels(0)
 	,	lastBuffer(false)
 	,	swr(NULL)
+	,	stretcher(NULL)
+	,	tempo(1.f)
+	,	stretching(false)
+	,	stretchTime(-1.0)
+	,	expectFlush(false)
+	,	awaitingFlush(false)
+	,	jumped(false)
+	,	skipUntil(-1.0)
 	{}
 	
 	AudioDecoder* AudioDecoder::open(Demuxer* de) {
@@ -455,6 +1892,7 @@ namespace jf {
 		dec->sampleRate = 44100;
 		dec->sampleSize = 2;
 		dec->channels = 2;
+		dec->bufferPool = BufferPool::create(dec->frameSize, 8);
 		
 		dec->swr = swr_alloc_set_opts(NULL,
 									  AV_CH_LAYOUT_STEREO,
@@ -466,13 +1904,18 @@ namespace jf {
 									  0,
 									  NULL);
 		swr_init(dec->swr);
+		dec->stretcher = TimeStretcher::create(dec->channels, dec->sampleRate);
 		
 		return dec;
 	}
 	
 	AudioDecoder::~AudioDecoder() {
+		BufferPool::Stats st = bufferPool->getStats();
+		printf("audio buffer pool:\n\t%lld hits\n\t%lld misses\n\t%lld peak bytes\n", st.hits, st.misses, st.peakResidentBytes);
+		
 		av_free(frame);
 		swr_free(&swr);
+		delete stretcher;
 	}
 	
 	bool AudioDecoder::isLastBuffer() const { return lastBuffer; }
@@ -480,12 +1923,16 @@ namespace jf {
 	int AudioDecoder::getSampleSize() const { return sampleSize; }
 	int AudioDecoder::getFrameSize() const { return frameSize; }
 	int AudioDecoder::getChannelCount() const { return context->channels; }
+	int AudioDecoder::getOutputChannelCount() const { return channels; }
+	BufferPool::Stats AudioDecoder::getBufferPoolStats() { return bufferPool->getStats(); }
 
 	AudioBuffer::Ptr AudioDecoder::convert(AVFrame* frame) {
 		// do the conversion
 		
 		double out = frame->pkt_dts * av_q2d(stream->time_base);
-		AudioBuffer::Ptr buffer = AudioBuffer::create(out, sampleRate, frameSize, NULL);
+		AudioBuffer::Ptr buffer = AudioBuffer::create(bufferPool, out, sampleRate);
+		if(!buffer)
+			return buffer;
 		
 		unsigned char* pointers[SWR_CH_MAX] = {NULL};
 		pointers[0] = buffer->bytes;
@@ -503,16 +1950,51 @@ namespace jf {
 	}
 	
 	AudioBuffer::Ptr AudioDecoder::nextBuffer() {
+		// at 1x it's decoded audio as is until somebody changes the tempo
+		if(!stretching && tempo == 1.f)
+			return decodeBuffer();
+		stretching = stretcher != NULL;
+		return stretching ? stretchBuffer() : decodeBuffer();
+	}
+	
+	AudioBuffer::Ptr AudioDecoder::stretchBuffer() {
+		int frames = frameSize / (sampleSize * channels);
+		stretcher->setTempo(tempo);
+		
+		while(stretcher->getAvailable() < frames) {
+			AudioBuffer::Ptr in = decodeBuffer();
+			if(!in)
+				break;
+			// first audio after a seek, the stretched timeline starts here
+			if(stretchTime < 0.0)
+				stretchTime = in->outTime;
+			stretcher->push((const int16_t*)in->bytes, in->numBytes / (sampleSize * channels));
+		}
+		
+		AudioBuffer::Ptr buffer = AudioBuffer::create(bufferPool, std::max(0.0, stretchTime), sampleRate);
+		if(!buffer)
+			return buffer;
+		
+		int n = stretcher->pull((int16_t*)buffer->bytes, frames);
+		if(n == 0)
+			return AudioBuffer::Ptr();
+		// the tail end of the movie
+		memset(buffer->bytes + n * sampleSize * channels, 0, (frames - n) * sampleSize * channels);
+		
+		buffer->tempo = stretcher->getTempo();
+		stretchTime = std::max(0.0, stretchTime) + n * (double)buffer->tempo / sampleRate;
+		return buffer;
+	}
+	
+	void AudioDecoder::setTempo(float t) { tempo = std::max(0.25f, std::min(16.f, t)); }
+	float AudioDecoder::getTempo() const { return tempo; }
+	
+	AudioBuffer::Ptr AudioDecoder::decodeBuffer() {
 		AVPacket packet;
 		AudioBuffer::Ptr buffer;
 		
 		int complete = 0;
 		while(!complete) {
-			if(packets->isEmpty()) {
-				// fetch more packets
-				demuxer->demux(streamIdx);
-			}
-			
 			if(!packets->pop(&packet)) {
 				// i guess we're out of packets
 				lastBuffer = true;
@@ -521,6 +2003,26 @@ namespace jf {
 			
 			if(PacketQueue::isFlushPacket(packet)) {
 				avcodec_flush_buffers(context);
+				
+				// somebody else moved the demuxer
+				if(expectFlush)
+					expectFlush = false;
+				else {
+					if(stretcher)
+						stretcher->reset();
+					stretching = false;
+					stretchTime = -1.0;
+					if(!awaitingFlush)
+						skipUntil = -1.0;
+					jumped = true;
+				}
+				awaitingFlush = false;
+				continue;
+			}
+			
+			// from before a seek that hasn't reached the demuxer yet
+			if(awaitingFlush) {
+				av_free_packet(&packet);
 				continue;
 			}
 			
@@ -544,14 +2046,36 @@ namespace jf {
 			}
 			
 			av_free_packet(&packet);
+			
+			// still on the way from the keyframe to where the seek wanted
+			if(buffer && buffer->outTime + 1024.0 / sampleRate <= skipUntil) {
+				buffer.reset();
+				complete = 0;
+			}
 		}
 
 		return buffer;
 	}
 	
 	void AudioDecoder::seekToTime(double time) {
+		expectFlush = true;
+		skipUntil = time;
 		demuxer->seekToTime(time);
 		lastBuffer = false;
+		
+		// nothing stretched from before the seek carries over
+		if(stretcher)
+			stretcher->reset();
+		stretching = false;
+		stretchTime = -1.0;
 	}
+	
+	void AudioDecoder::followSeek(double time) {
+		skipUntil = time;
+		awaitingFlush = true;
+		lastBuffer = false;
+	}
+	
+	bool AudioDecoder::hasJumped() { return jumped.exchange(false); }
 
 }
\ No newline at end of file
@@ -17,52 +17,289 @@ extern "C" {
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
 
 #include "render.h"
+#include "convert.h"
+#include "seekindex.h"
 
 namespace jf {
 	
-	class PacketQueue {
-		std::list<AVPacket> packets;
+	class Demuxer;
+	class GopCache;
+	
+	// how a stream's codec gets opened, only the first open of a stream counts
+	class DecoderOptions {
+	public:
+		int threadCount;	// 0 uses every core
+		int threadType;		// FF_THREAD_FRAME and/or FF_THREAD_SLICE
+		bool lowDelay;		// no frame threading, frames come out as soon as they're decoded
+		int maxWidth, maxHeight;	// biggest the picture is ever shown, 0 for full size
 		
+		DecoderOptions();
+		DecoderOptions& setThreads(int count, int type=FF_THREAD_FRAME|FF_THREAD_SLICE);
+		DecoderOptions& setLowDelay(bool low);
+		// codecs that can decode at 1/2, 1/4 or 1/8 size (lowres) do it at the
+		// smallest that still fills width x height with the picture's aspect
+		DecoderOptions& setMaxSize(int width, int height);
+	};
+	
+	// which tracks a Demuxer reads. everything else is discarded in the
+	// container, so its packets are skipped rather than read and thrown away
+	class StreamSelection {
 	public:
-		PacketQueue();
+		bool video, audio;						// false leaves that kind out altogether
+		int videoIndex, audioIndex;				// a stream index, -1 for no preference
+		std::string videoLanguage, audioLanguage;	// the stream's "language" tag, e.g. "eng"
+		
+		// the best video and audio tracks, whatever their language
+		StreamSelection();
+		StreamSelection& setVideo(bool on);
+		StreamSelection& setAudio(bool on);
+		StreamSelection& setVideoTrack(int streamIdx);
+		StreamSelection& setAudioTrack(int streamIdx);
+		StreamSelection& setVideoLanguage(const char* language);
+		StreamSelection& setAudioLanguage(const char* language);
+	};
+	
+	// single-producer/single-consumer ring of packets. the demux thread
+	// (or whoever holds the demuxer's io lock) pushes, one decoder pops.
+	class PacketQueue {
+	public:
+		// the demux thread reads until a queue reaches its high mark,
+		// then waits until one drains below its low mark
+		struct Watermarks {
+			int64_t lowBytes, highBytes;
+			double lowDuration, highDuration;
+			
+			Watermarks();
+		};
+		
+		// owner is woken when the queue runs low, NULL for one on its own
+		PacketQueue(Demuxer* owner, AVRational timeBase, int capacity=1024);
+		~PacketQueue();
 		bool isEmpty();
-		void push(AVPacket pkt);
+		// producer side, takes ownership of pkt, returns false if the ring is full
+		bool push(AVPacket pkt);
+		// consumer side, blocks until a packet arrives, returns 0 once empty at end of file
 		int pop(AVPacket* pkt);
+		// producer side, everything queued so far is dropped and the
+		// consumer gets a FlushPacket before anything pushed afterwards
 		void flush();
+		void setEndOfFile();
+		
+		void setWatermarks(const Watermarks& w);
+		bool isFull();
+		bool isHungry();
+		bool isOverflowing();
+		bool hasRoom();
+		int64_t getBytes();
+		double getDuration();
+		// producer side, the demuxer is holding packets this queue had no room for
+		void setBackedUp(bool b);
+		bool isBackedUp();
 		
 		static AVPacket FlushPacket;
 		static bool isFlushPacket(AVPacket pct);
+		
+	private:
+		PacketQueue(const PacketQueue&) =delete;
+		PacketQueue& operator=(const PacketQueue&) =delete;
+		
+		static const int CacheLine = 64;
+		
+		struct Slot {
+			AVPacket packet;
+			uint32_t serial;
+		};
+		
+		void notifyConsumer();
+		
+		Demuxer* owner;
+		AVRational timeBase;
+		uint32_t mask;
+		Slot* slots;
+		
+		std::atomic<int64_t> lowBytes, highBytes;
+		std::atomic<double> lowDuration, highDuration;
+		
+		// producer and consumer indices live on their own cache lines, each
+		// side keeps a stale copy of the other's index to avoid touching it
+		// running totals are split the same way, so the watermarks are
+		// pushed minus popped and neither side needs a locked add
+		char pad0[CacheLine];
+		std::atomic<uint32_t> tail;
+		uint32_t cachedHead;
+		std::atomic<uint32_t> serial;
+		std::atomic<int64_t> pushedBytes, pushedTicks;
+		
+		char pad1[CacheLine];
+		std::atomic<uint32_t> head;
+		uint32_t cachedTail;
+		uint32_t consumedSerial;
+		std::atomic<int64_t> poppedBytes, poppedTicks;
+		
+		char pad2[CacheLine];
+		std::atomic<bool> endOfFile;
+		std::atomic<bool> backedUp;
+		
+		// slow path for a consumer that finds the ring empty
+		std::atomic<bool> consumerWaiting;
+		std::mutex mutex;
+		std::condition_variable available;
 	};
 	
 	class Demuxer {
 	public:
-		static Demuxer* open(const char*);
+		// video keyframes are indexed as they're read, these get a complete
+		// index up front so every seek is exact from the start
+		enum OpenFlags {
+			ScanKeyframes = 1,	// read the whole file through once
+			UseSeekIndex = 2,	// load <path>.seekindex if it's current, skips the scan and the probing
+			WriteSeekIndex = 4,	// save <path>.seekindex after a scan
+			Deferred = 8		// nothing is read until start(), so every queue gets the first packet
+		};
+		
+		// packets av_read_frame handed over and the ones a queue took, plus
+		// the ones held back for a stream so far ahead it was starving another
+		struct ReadStats {
+			int64_t packetsRead, bytesRead;
+			int64_t packetsUsed, bytesUsed;
+			int64_t packetsParked, mostParked;
+		};
+		
+		static Demuxer* open(const char*, int flags=0, const StreamSelection& selection=StreamSelection());
 		~Demuxer();
 		
+		const char* getPath();
 		AVFormatContext* getFormat();
+		// the selected stream, -1 if there isn't one of that type
 		int getStreamIndex(AVMediaType);
 		AVStream* getStream(int streamIdx);
-		PacketQueue* getPacketQueue(int streamIdx);
+		PacketQueue* getPacketQueue(int streamIdx, const DecoderOptions& options=DecoderOptions());
+		// NULL for streams that aren't video
+		KeyframeIndex* getKeyframeIndex(int streamIdx);
+		
+		ReadStats getReadStats();
 		
-		// trigger loading packets into all registered queues
-		void demux(int streamIndx);
+		// starts reading when opened Deferred, once every queue is made
+		void start();
+		// wake the demux thread, called by queues as they drain
+		void wakeUp();
 
+		// lands on the nearest keyframe at or before time on the video stream
 		void seekToTime(double time);
 		
 	private:
 		Demuxer();
 		
+		// demux thread body, fills all registered queues ahead of consumption
+		void demux();
+		bool wantsPackets();
+		bool wantsToRead();
+		// some parked packets have room in their queue now
+		bool canUnpark();
+		// called with ioMutex held, moves parked packets over in order
+		void unpark();
+		void scanKeyframes();
+		// sidecar streams have to line up with what the header gave us
+		bool applySeekIndex(const SeekIndexFile* file);
+		bool writeSeekIndex(const char* path);
+		// called with ioMutex held for every packet read
+		void indexPacket(const AVPacket& packet);
+		// by index, then language, then whatever ffmpeg thinks is best
+		int pickStream(AVMediaType type, int index, const std::string& language);
+		void selectStreams(const StreamSelection& selection);
+		
+		std::string path;
 		AVFormatContext* format;
-		std::map<int,PacketQueue*> packetQueues;
+		// indexed by stream, NULL for streams nobody asked for
+		std::vector<PacketQueue*> packetQueues;
+		
+		// indexed by stream, NULL for anything but video. frame numbers are
+		// only known until the first seek, after that we've lost count
+		std::vector<KeyframeIndex*> keyframeIndexes;
+		std::vector<int64_t> packetCounts;
+		bool countingFrames;
+		int seekStream;
+		int videoStream, audioStream;
+		// written by the demux thread with ioMutex held
+		ReadStats readStats;
+		
+		// ioMutex guards the format context, stateMutex guards the wait predicate
+		std::mutex ioMutex, stateMutex;
+		std::condition_variable wake;
+		std::thread demuxThread;
+		std::atomic<bool> sleeping;
+		bool atEndOfFile;
+		bool quit;
+		
+		// indexed by stream, packets read while their queue had no room.
+		// a starving stream reads straight past its siblings' high marks,
+		// so the packets it passes wait here instead of being thrown away.
+		// guarded by ioMutex
+		std::vector<std::deque<AVPacket>> parked;
+		int64_t parkedCount;
 	};
 	
-	// single frame of RGB video
+	// recycles fixed-size, 64 byte aligned buffers for one stream's frames.
+	// frames hold a reference, so the pool outlives the decoder if it has to
+	class BufferPool {
+	public:
+		typedef std::shared_ptr<BufferPool> Ptr;
+		
+		struct Stats {
+			int64_t hits, misses;
+			int64_t residentBytes, peakResidentBytes;
+		};
+		
+		static Ptr create(int bufferSize, int maxIdle=4);
+		~BufferPool();
+		
+		uint8_t* acquire();
+		void release(uint8_t* buf);
+		
+		void setMaxIdle(int n);
+		int getBufferSize() const;
+		Stats getStats();
+		
+		static const int Alignment = 64;
+		
+	private:
+		BufferPool();
+		BufferPool(const BufferPool&) =delete;
+		BufferPool& operator=(const BufferPool&) =delete;
+		
+		std::mutex mutex;
+		std::vector<uint8_t*> idle;
+		int bufferSize, maxIdle;
+		Stats stats;
+	};
+	
+	// memory other than the heap for frames to be converted into, e.g. pixel
+	// buffers a renderer has mapped for upload. called from whichever
+	// thread is decoding
+	class FrameTarget {
+	public:
+		virtual ~FrameTarget();
+		
+		// size bytes and an id for them, or -1 if nothing's free right now
+		// and the frame should go on the heap
+		virtual int acquire(int size, uint8_t** bytes) =0;
+		// the frame they were handed to is gone
+		virtual void release(int id) =0;
+	};
+	
+	// single frame of video, either packed RGB or tightly packed YUV planes
 	struct VideoFrame {
 		typedef std::shared_ptr<VideoFrame> Ptr;
 		
@@ -70,11 +307,28 @@ namespace jf {
 		int height;
 		int numBytes;
 		uint8_t* bytes;
+		// the FrameTarget's id for bytes, -1 if they're on the heap
+		int targetId;
+		
+		// PIX_FMT_RGB24 has one plane, YUV420P three, NV12 two (Y then interleaved UV)
+		PixelFormat format;
+		int numPlanes;
+		int planeOffsets[3];
+		int planeWidths[3];
+		int planeHeights[3];
+		AVColorSpace colorSpace;
+		bool fullRange;
 		
 		double outTime;
+		double nextTime;
+		int64_t pts;
 		
 		~VideoFrame();
 		static Ptr create(double o, int w, int h, int sz, uint8_t* ptr);
+		// bytes come from, and go back to, pool
+		static Ptr create(BufferPool::Ptr pool, double o, int w, int h);
+		// NULL if target has nothing free, it has to outlive the frame
+		static Ptr create(FrameTarget* target, double o, int w, int h, int sz);
 		
 	private:
 		VideoFrame();
@@ -90,9 +344,13 @@ namespace jf {
 		uint8_t* bytes;
 		
 		double outTime;
+		// seconds of movie per second played, not 1 once time-stretched
+		float tempo;
 		
 		~AudioBuffer();
 		static Ptr create(double o, int sr, int sz, uint8_t* ptr);
+		// bytes come from, and go back to, pool
+		static Ptr create(BufferPool::Ptr pool, double o, int sr);
 		
 	private:
 		AudioBuffer();
@@ -102,7 +360,35 @@ namespace jf {
 
 	class VideoDecoder  {
 	public:
-		static VideoDecoder* open(Demuxer*);
+		enum OutputFormat {
+			OutputRGB,	// converted to PIX_FMT_RGB24 on the cpu
+			OutputRGBA,	// PIX_FMT_RGBA
+			OutputBGRA,	// PIX_FMT_BGRA
+			OutputYUV	// decoder's own YUV420P/NV12 planes, colour converted by the renderer
+		};
+		
+		// seconds spent in avcodec_decode_video2 and in getting its output into a VideoFrame
+		struct DecodeStats {
+			int64_t frames;
+			double decodeTime;
+			double convertTime;
+			// scrubToTime calls and the seconds they took all told
+			int64_t scrubs;
+			double scrubTime;
+			// seeks that got a frame on screen and the seconds from asking to
+			// showing, plus the ones a later seek replaced first
+			int64_t seeks, seeksSuperseded;
+			double seekLatency;
+			// frames that made it to present(), late ones skipped over don't count
+			int64_t shown;
+			// late frames decoded but never converted, and converted ones a
+			// later frame overtook in the queue
+			int64_t dropped, overtaken;
+			// converted straight into the FrameTarget rather than the heap
+			int64_t targeted;
+		};
+		
+		static VideoDecoder* open(Demuxer*, const DecoderOptions& options=DecoderOptions());
 		~VideoDecoder();
 		
 		int getWidth();
@@ -110,18 +396,89 @@ namespace jf {
 		int getBytesPerFrame();
 		bool isLastFrame();
 		
+		// drops any decoded-ahead frames in the old format
+		void setOutputFormat(OutputFormat fmt);
+		OutputFormat getOutputFormat();
+		// frames come out scaled to fit width x height, keeping their aspect.
+		// never bigger than decoded, 0 for the decoded size. drops any
+		// decoded-ahead frames in the old size
+		void setOutputSize(int width, int height);
+		// frames are converted into target while it has room, the heap
+		// otherwise. it has to outlive every frame it hands memory to, NULL
+		// drops the decoded-ahead ones so it can go
+		void setFrameTarget(FrameTarget* target);
+		BufferPool::Stats getFramePoolStats();
+		DecodeStats getDecodeStats();
+		
+		// steps back through a cache of decoded frames, the first step back
+		// into a GOP decodes it, later ones are free
 		VideoFrame::Ptr previousFrame();
 		VideoFrame::Ptr nextFrame();
+		// latest frame due at time, NULL if the current one is still good
+		VideoFrame::Ptr frameForTime(double time);
+		
+		// playing backwards, frames come from the GOP cache a GOP at a time with
+		// the one before decoding in the background. NULL if the current frame is
+		// still good or the cache has fallen behind, which gets reported
+		void setReverse(bool reverse);
+		bool isReverse();
+		VideoFrame::Ptr reverseFrameForTime(double time);
+		
+		// dragging the timeline, only the keyframe at or before time is decoded
+		// so each step costs one frame. once scrubbing has stopped for the
+		// settle delay, refineScrub() returns the exact frame
+		VideoFrame::Ptr scrubToTime(double time);
+		VideoFrame::Ptr refineScrub();
+		bool isScrubbing();
+		void setScrubSettleDelay(double sec);
+		
+		// the master clock's time, frames that finish before it are decoded
+		// (later ones need them) but not converted. negative turns it off
+		void setLateTime(double time);
+		
+		// how fast frames are being asked for. past 2x the decoder skips
+		// non-reference frames, past 4x everything but keyframes
+		void setPlaybackRate(double rate);
+		AVDiscard getSkipLevel();
+		
+		// keep this many converted frames ready on a worker thread, 0 decodes inline
+		void setDecodeAhead(int frames);
+		int getDecodeAhead();
+		
+		// bands each frame is colour converted in on the shared worker pool, 0 is one per core
+		void setConvertSlices(int slices);
+		int getConvertSlices();
+		
+		// memory for frames kept for stepping backwards, 0 turns the cache off
+		void setGopCacheBudget(int64_t bytes);
+		int64_t getGopCacheBudget();
 		
 		int64_t getCurrentFrame();
 		double getCurrentTime();
 		double getNextTime();
 		
 		void seekToFrame(int64_t frame);
-		void seekToTime(double time);
+		// exact stops on the frame showing at time, otherwise frames come
+		// from the keyframe at or before it. doesn't wait: the newest request
+		// replaces any that haven't started and stops one still decoding
+		// towards its target. the first frame after it is due straight away
+		void seekToTime(double time, bool exact=true);
+		// a seek hasn't got a frame on screen yet
+		bool isSeeking();
 		
 	private:
 		VideoDecoder();
+		// puts the decoder back where the last cached frame left off
+		void resync();
+		void configureOutput();
+		// starts the newest seek request, if there is one
+		void applySeek();
+		VideoFrame::Ptr decodeFrame();
+		// the decode itself, counting into tally rather than decodeStats
+		VideoFrame::Ptr decodeFrame(DecodeStats& tally);
+		void present(VideoFrame::Ptr frame);
+		void decodeAhead();
+		void stopDecodeAhead();
 		
 		Demuxer* demuxer;
 		PacketQueue* packets;
@@ -129,17 +486,74 @@ namespace jf {
 		int streamIdx;
 		AVStream* stream;
 		AVCodecContext* context;
-		AVFrame *frame, *frameRGB;
-		SwsContext* sws;
+		AVFrame *frame, *frameOut;
+		// NULL when the decoder already produces the output format
+		ColorConverter* converter;
+		FrameTarget* frameTarget;
+		OutputFormat outputFormat;
+		PixelFormat outPixFmt;
+		int convertSlices;
+		AVDiscard skipLevel;
+		BufferPool::Ptr framePool;
 		
 		double clock;
 		double nextFrameTime;
 		int64_t currentFrame;
 		int64_t currentDts;
 		int width, height, bytesPerFrame;
-		bool lastFrame;
+		// what setOutputSize asked for, width and height are what fits in it
+		int maxWidth, maxHeight;
+		std::atomic<bool> lastFrame;
+		// guarded by queueMutex, the worker and render thread both count into it
+		DecodeStats decodeStats;
+		
+		// after this many dropped in a row one goes up anyway, so a decoder
+		// that can't keep up at all still shows something
+		static const int MaxLateRun = 8;
+		std::atomic<double> lateTime;
+		int lateRun;
+		
+		// frames before seekTarget are decoded but not converted. if the first
+		// one out after a seek is already late, the demuxer backs up by seekBackoff
+		double seekTarget, seekFrom, seekBackoff;
+		// where the last decoded frame ended, for ones without any timestamp
+		double decodedEnd;
+		bool seekLanded, seekExact;
+		
+		// the seek mailbox, guarded by queueMutex. seekSerial goes up with
+		// every request so a decode can tell it's been overtaken. seekUnshown
+		// is written under it too, but the worker's late check reads it bare
+		bool seekPending, seekPendingExact;
+		std::atomic<bool> seekUnshown;
+		double seekPendingTime;
+		std::atomic<int> seekSerial;
+		std::chrono::steady_clock::time_point seekRequested;
+		
+		// opened on the first step back. after showing a cached frame the decoder
+		// is somewhere else, so it seeks to resyncTime before decoding on
+		GopCache* gopCache;
+		int64_t gopCacheBudget;
+		bool needsResync;
+		double resyncTime;
+		bool reverse, reverseStalled;
+		double stallTime;
+		
+		// the decode-ahead worker sits out a scrub
+		bool scrubbing;
+		double scrubTarget, scrubSettleDelay;
+		std::chrono::steady_clock::time_point scrubMoved;
+		
+		// decodeMutex is held for each decode and for seeks, queueMutex guards frames
+		int aheadDepth;
+		std::deque<VideoFrame::Ptr> frames;
+		std::mutex decodeMutex, queueMutex;
+		std::condition_variable queueChanged;
+		std::thread aheadThread;
+		bool quitAhead;
 	};
 	
+	class TimeStretcher;
+	
 	class AudioDecoder {
 	public:
 		static AudioDecoder* open(Demuxer*);
@@ -149,14 +563,30 @@ namespace jf {
 		int getSampleRate() const;
 		int getSampleSize() const;
 		int getFrameSize() const;
+		// the source's channels, buffers always come out as getOutputChannelCount()
 		int getChannelCount() const;
+		int getOutputChannelCount() const;
+		BufferPool::Stats getBufferPoolStats();
 		AudioBuffer::Ptr nextBuffer();
 		
+		// buffers after convert go through a pitch preserving time-stretch
+		// once the tempo has been anything but 1
+		void setTempo(float tempo);
+		float getTempo() const;
+		
 		void seekToTime(double time);
+		// somebody else sharing the demuxer is about to seek it to time. packets
+		// are dropped until its flush turns up, then anything before time
+		void followSeek(double time);
+		// true once after a flush this decoder didn't ask for, whoever queued
+		// its earlier buffers should throw them out
+		bool hasJumped();
 		
 	private:
 		AudioDecoder();
 		AudioBuffer::Ptr convert(AVFrame*);
+		AudioBuffer::Ptr decodeBuffer();
+		AudioBuffer::Ptr stretchBuffer();
 		
 		Demuxer* demuxer;
 		PacketQueue* packets;
@@ -166,11 +596,22 @@ namespace jf {
 		AVCodecContext* context;
 		AVFrame* frame;
 		SwrContext* swr;
+		BufferPool::Ptr bufferPool;
 		
 		int frameSize;
 		int channels, sampleRate, sampleSize;
 		
 		bool lastBuffer;
+		
+		TimeStretcher* stretcher;
+		std::atomic<float> tempo;
+		bool stretching;
+		// movie time of the next stretched sample
+		double stretchTime;
+		
+		// buffers that finish before skipUntil are decoded and dropped
+		std::atomic<bool> expectFlush, awaitingFlush, jumped;
+		std::atomic<double> skipUntil;
 	};
 
 }
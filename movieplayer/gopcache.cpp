@@ -0,0 +1,339 @@
+//
+//  gopcache.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "gopcache.h"
+
+#include <cstring>
+#include <iterator>
+
+namespace jf {
+	
+	// slack when comparing frame times, well under a frame at any real rate
+	static const double Epsilon = 1e-4;
+	// stepping this close to the start of a run refills the one before it
+	static const int RefillDistance = 8;
+	
+	static bool startsBefore(const VideoFrame::Ptr& f, double time) {
+		return f->outTime < time;
+	}
+	
+	GopCache::GopCache()
+	:	demuxer(NULL)
+	,	decoder(NULL)
+	,	budget(0)
+	,	bytesPerFrame(1)
+	,	lastTime(0.0)
+	,	earliest(-1.0)
+	,	wanted(-1.0)
+	,	decoding(-1.0)
+	,	pending(false)
+	,	busy(false)
+	,	requested(0)
+	,	completed(0)
+	,	reverse(false)
+	,	quit(false)
+	{
+		memset(&stats, 0, sizeof(Stats));
+	}
+	
+	GopCache* GopCache::open(const char* path, int streamIdx, VideoDecoder::OutputFormat format, int maxWidth, int maxHeight,
+							 int convertSlices, int64_t budgetBytes)
+	{
+		Demuxer* de = Demuxer::open(path, Demuxer::UseSeekIndex, StreamSelection().setVideoTrack(streamIdx).setAudio(false));
+		if(!de)
+			return NULL;
+		
+		VideoDecoder* dec = VideoDecoder::open(de, DecoderOptions().setMaxSize(maxWidth, maxHeight));
+		if(!dec) {
+			delete de;
+			return NULL;
+		}
+		dec->setOutputFormat(format);
+		dec->setOutputSize(maxWidth, maxHeight);
+		dec->setConvertSlices(convertSlices);
+		
+		GopCache* cache = new GopCache();
+		cache->demuxer = de;
+		cache->decoder = dec;
+		cache->budget = budgetBytes;
+		cache->bytesPerFrame = std::max(1, dec->getBytesPerFrame());
+		cache->worker = std::thread(&GopCache::refill, cache);
+		return cache;
+	}
+	
+	GopCache::~GopCache() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		changed.notify_all();
+		if(worker.joinable())
+			worker.join();
+		
+		printf("gop cache:\n\t%lld hits\n\t%lld misses\n\t%lld refills\n\t%lld underruns\n\t%lld truncated gops\n",
+			   stats.hits, stats.misses, stats.refills, stats.underruns, stats.truncated);
+		
+		runs.clear();
+		delete decoder;
+		delete demuxer;
+	}
+	
+	VideoFrame::Ptr GopCache::frameBefore(double time) {
+		std::unique_lock<std::mutex> lock(mutex);
+		lastTime = time;
+		
+		double refillFrom = -1.0;
+		VideoFrame::Ptr rez = findBefore(time, &refillFrom);
+		if(rez) {
+			stats.hits++;
+		}
+		else {
+			// nothing for it but to decode up to it and wait
+			stats.misses++;
+			if(!request(time - Epsilon))
+				return rez;
+			
+			int64_t ticket = requested;
+			changed.wait(lock, [this, ticket]() { return quit || completed >= ticket; });
+			rez = findBefore(time, &refillFrom);
+		}
+		
+		// getting close to the start of this run, have the one before it ready
+		if(refillFrom >= 0.0)
+			request(refillFrom - Epsilon);
+		
+		return rez;
+	}
+	
+	VideoFrame::Ptr GopCache::frameAfter(double time) {
+		std::lock_guard<std::mutex> lock(mutex);
+		lastTime = time;
+		
+		for(Run& run : runs) {
+			// only if the frame at time is in this run too, otherwise there's a gap
+			auto it = std::lower_bound(run.begin(), run.end(), time - Epsilon, startsBefore);
+			if(it == run.end() || (*it)->outTime > time + Epsilon || ++it == run.end())
+				continue;
+			
+			stats.hits++;
+			return *it;
+		}
+		
+		return VideoFrame::Ptr();
+	}
+	
+	VideoFrame::Ptr GopCache::frameAt(double time) {
+		std::lock_guard<std::mutex> lock(mutex);
+		lastTime = time;
+		
+		for(Run& run : runs) {
+			if(run.front()->outTime > time + Epsilon || run.back()->nextTime <= time)
+				continue;
+			
+			// last frame that starts at or before time
+			auto it = std::lower_bound(run.begin(), run.end(), time + Epsilon, startsBefore) - 1;
+			
+			bool atStart = earliest >= 0.0 && run.front()->outTime <= earliest + Epsilon;
+			if(reverse && !atStart)
+				request(run.front()->outTime - Epsilon);
+			
+			stats.hits++;
+			return *it;
+		}
+		
+		// fallen behind, get going on it
+		stats.underruns++;
+		request(time);
+		return VideoFrame::Ptr();
+	}
+	
+	void GopCache::setReverse(bool r) {
+		std::lock_guard<std::mutex> lock(mutex);
+		reverse = r;
+	}
+	
+	GopCache::Stats GopCache::getStats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.residentBytes = getResidentFrames() * bytesPerFrame;
+		return stats;
+	}
+	
+	int64_t GopCache::getResidentFrames() {
+		int64_t frames = 0;
+		for(Run& run : runs)
+			frames += run.size();
+		return frames;
+	}
+	
+	VideoFrame::Ptr GopCache::findBefore(double time, double* refillFrom) {
+		for(Run& run : runs) {
+			if(run.front()->outTime >= time - Epsilon || run.back()->nextTime + Epsilon < time)
+				continue;
+			
+			// last frame that starts before time
+			auto it = std::lower_bound(run.begin(), run.end(), time - Epsilon, startsBefore) - 1;
+			
+			bool atStart = earliest >= 0.0 && run.front()->outTime <= earliest + Epsilon;
+			if(it - run.begin() < RefillDistance && !atStart)
+				*refillFrom = run.front()->outTime;
+			return *it;
+		}
+		
+		return VideoFrame::Ptr();
+	}
+	
+	bool GopCache::covers(double time) {
+		for(Run& run : runs)
+			if(run.front()->outTime <= time && time < run.back()->nextTime)
+				return true;
+		return false;
+	}
+	
+	bool GopCache::request(double upTo) {
+		if(covers(upTo))
+			return false;
+		
+		// already on it
+		if((pending && fabs(wanted - upTo) < Epsilon) || (busy && fabs(decoding - upTo) < Epsilon))
+			return true;
+		
+		// newest request wins, the worker only ever has one to do
+		wanted = upTo;
+		pending = true;
+		requested++;
+		changed.notify_all();
+		return true;
+	}
+	
+	void GopCache::insert(Run& run) {
+		if(run.empty())
+			return;
+		
+		// soak up every run this one overlaps or butts up against
+		for(size_t i=0; i<runs.size(); ) {
+			Run& other = runs[i];
+			bool touching = other.back()->nextTime + Epsilon >= run.front()->outTime
+						 && run.back()->nextTime + Epsilon >= other.front()->outTime;
+			if(!touching) {
+				i++;
+				continue;
+			}
+			
+			Run merged;
+			std::merge(run.begin(), run.end(), other.begin(), other.end(), std::back_inserter(merged),
+					   [](const VideoFrame::Ptr& a, const VideoFrame::Ptr& b) { return a->outTime < b->outTime; });
+			run.clear();
+			for(VideoFrame::Ptr& f : merged)
+				if(run.empty() || f->outTime > run.back()->outTime + Epsilon)
+					run.push_back(f);
+			
+			runs.erase(runs.begin() + i);
+			i = 0;
+		}
+		
+		runs.push_back(run);
+	}
+	
+	void GopCache::trim(int64_t maxFrames) {
+		int64_t frames = getResidentFrames();
+		
+		// drop whatever is furthest from where the user is, or in reverse
+		// whatever has already been shown
+		while(frames > maxFrames) {
+			Run* victim = NULL;
+			bool back = false;
+			double distance = -1.0;
+			for(Run& run : runs) {
+				double front = fabs(run.front()->outTime - lastTime);
+				double end = fabs(run.back()->outTime - lastTime);
+				if(reverse && run.back()->outTime > lastTime + Epsilon)
+					end += 1e9;
+				
+				if(front > distance) {
+					victim = &run;
+					back = false;
+					distance = front;
+				}
+				if(end > distance) {
+					victim = &run;
+					back = true;
+					distance = end;
+				}
+			}
+			
+			if(back)
+				victim->pop_back();
+			else
+				victim->pop_front();
+			frames--;
+			
+			if(victim->empty())
+				runs.erase(runs.begin() + (victim - &runs[0]));
+		}
+	}
+	
+	void GopCache::refill() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			changed.wait(lock, [this]() { return quit || pending; });
+			if(quit)
+				return;
+			
+			double upTo = wanted;
+			int64_t ticket = requested;
+			pending = false;
+			busy = true;
+			decoding = upTo;
+			
+			// in reverse, make room first so the budget holds while decoding
+			int64_t maxFrames = std::max<int64_t>(1, budget / bytesPerFrame);
+			int64_t room = maxFrames;
+			if(reverse) {
+				trim(maxFrames / 2);
+				room = std::max<int64_t>(1, maxFrames - getResidentFrames());
+			}
+			
+			lock.unlock();
+			bool truncated = false;
+			Run run = decodeUpTo(upTo, room, &truncated);
+			lock.lock();
+			
+			// nothing comes before the first frame, don't keep asking
+			if(!run.empty() && run.front()->outTime >= upTo)
+				earliest = run.front()->outTime;
+			
+			insert(run);
+			trim(maxFrames);
+			stats.refills++;
+			if(truncated)
+				stats.truncated++;
+			busy = false;
+			completed = ticket;
+			changed.notify_all();
+		}
+	}
+	
+	GopCache::Run GopCache::decodeUpTo(double upTo, int64_t maxFrames, bool* truncated) {
+		Run run;
+		
+		// from the keyframe, through the frame showing at upTo
+		decoder->seekToTime(upTo, false);
+		while(VideoFrame::Ptr f = decoder->nextFrame()) {
+			run.push_back(f);
+			// the frames nearest upTo are the ones that were asked for
+			if(run.size() > maxFrames) {
+				run.pop_front();
+				*truncated = true;
+			}
+			if(f->nextTime > upTo)
+				break;
+		}
+		
+		return run;
+	}
+	
+}
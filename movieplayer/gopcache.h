@@ -0,0 +1,89 @@
+//
+//  gopcache.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include "decoder.h"
+
+namespace jf {
+	
+	// decoded runs of frames for stepping backwards, so each step back doesn't
+	// decode from the keyframe again. runs come from a second demuxer and
+	// decoder on the same file, so filling one never moves playback
+	class GopCache {
+	public:
+		struct Stats {
+			int64_t hits, misses, refills;
+			// reverse lookups that weren't decoded yet, GOPs that didn't fit the budget
+			int64_t underruns, truncated;
+			int64_t residentBytes;
+		};
+		
+		// NULL if path can't be opened a second time. only streamIdx is read,
+		// and decoded no bigger than it's shown, the same as the player's decoder
+		static GopCache* open(const char* path, int streamIdx, VideoDecoder::OutputFormat format, int maxWidth, int maxHeight,
+							  int convertSlices, int64_t budgetBytes);
+		~GopCache();
+		
+		// frame just before the one showing at time. a miss decodes from the
+		// keyframe up to it and waits, NULL if even that doesn't find one
+		VideoFrame::Ptr frameBefore(double time);
+		// frame just after the one showing at time, NULL if it isn't cached
+		VideoFrame::Ptr frameAfter(double time);
+		// frame showing at time without waiting, NULL if it isn't decoded yet.
+		// playing in reverse, the GOP before it starts decoding straight away
+		VideoFrame::Ptr frameAt(double time);
+		
+		// in reverse, frames later than the last lookup have been shown and go first
+		void setReverse(bool r);
+		
+		Stats getStats();
+		
+	private:
+		GopCache();
+		GopCache(const GopCache&) =delete;
+		GopCache& operator=(const GopCache&) =delete;
+		
+		// consecutive decoded frames in presentation order
+		typedef std::deque<VideoFrame::Ptr> Run;
+		
+		// called with mutex held. refillFrom is set to the start of the run when
+		// the frame found is near it
+		VideoFrame::Ptr findBefore(double time, double* refillFrom);
+		bool covers(double time);
+		// false if there's no need, it's already cached
+		bool request(double upTo);
+		void insert(Run& run);
+		void trim(int64_t maxFrames);
+		int64_t getResidentFrames();
+		
+		// worker body, decodes from the keyframe up to each requested time
+		void refill();
+		Run decodeUpTo(double upTo, int64_t maxFrames, bool* truncated);
+		
+		Demuxer* demuxer;
+		VideoDecoder* decoder;
+		int64_t budget;
+		int64_t bytesPerFrame;
+		
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::thread worker;
+		std::vector<Run> runs;
+		double lastTime;
+		// time of the first frame in the movie, once we've run into it
+		double earliest;
+		// the worker decodes up to wanted, requests are numbered so a miss can wait for its own
+		double wanted, decoding;
+		bool pending, busy;
+		int64_t requested, completed;
+		bool reverse;
+		bool quit;
+		Stats stats;
+	};
+	
+}
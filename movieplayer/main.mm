@@ -8,9 +8,20 @@
 
 #include "movie.h"
 #include "audio.h"
+#include "decoder.h"
+#include "convert.h"
+#include "wall.h"
 
 #include <string>
 #include <fstream>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 #include <unistd.h>
 
 #include <SDL.h>
@@ -30,7 +41,338 @@ std::string readFile(const std::string& path) {
 	return response;
 }
 
+// decodes the whole movie once per thread count, 1 through every core
+void decodeReport(const char* path) {
+	using namespace jf;
+	int cores = std::max(1u, std::thread::hardware_concurrency());
+	double baseline = 0.0;
+	
+	printf("threads\tframes\tdecode fps\tspeedup\n");
+	for(int threads=1; threads<=cores; threads++) {
+		Demuxer* demuxer = Demuxer::open(path, 0, StreamSelection().setAudio(false));
+		VideoDecoder* decoder = VideoDecoder::open(demuxer, DecoderOptions().setThreads(threads));
+		if(!decoder) {
+			printf("couldn't decode %s\n", path);
+			delete demuxer;
+			return;
+		}
+		
+		// skip colour conversion, only the codec is being timed
+		decoder->setOutputFormat(VideoDecoder::OutputYUV);
+		while(decoder->nextFrame())
+			;
+		
+		VideoDecoder::DecodeStats stats = decoder->getDecodeStats();
+		double fps = stats.frames / stats.decodeTime;
+		if(threads == 1)
+			baseline = fps;
+		printf("%d\t%lld\t%f\t%.2fx\n", threads, stats.frames, fps, fps / baseline);
+		
+		delete decoder;
+		delete demuxer;
+	}
+}
+
+// times each colour conversion kernel against swscale, one thread, a
+// YUV420P picture at each size into each rgb format
+void convertReport() {
+	using namespace jf;
+	static const int Sizes[][2] = {{640,360}, {1280,720}, {1920,1080}, {3840,2160}};
+	static const PixelFormat Formats[] = {PIX_FMT_RGB24, PIX_FMT_RGBA, PIX_FMT_BGRA};
+	static const ColorConverter::Kernel Kernels[] = {ColorConverter::Scalar, ColorConverter::SSE41, ColorConverter::AVX2, ColorConverter::Swscale};
+	static const double MinTime = 0.5;
+	
+	printf("size\tformat");
+	for(ColorConverter::Kernel k : Kernels)
+		printf("\t%s ms", ColorConverter::getKernelName(k));
+	printf("\n");
+	
+	for(auto& size : Sizes) {
+		int w = size[0], h = size[1];
+		int cw = (w + 1) / 2, ch = (h + 1) / 2;
+		
+		// something other than flat grey, so nothing gets a free ride
+		std::vector<uint8_t> y(w * h), u(cw * ch), v(cw * ch);
+		for(size_t i=0; i<y.size(); i++)
+			y[i] = (uint8_t)(i * 7);
+		for(size_t i=0; i<u.size(); i++) {
+			u[i] = (uint8_t)(i * 3);
+			v[i] = (uint8_t)(255 - i * 5);
+		}
+		const uint8_t* src[] = {&y[0], &u[0], &v[0]};
+		int srcStride[] = {w, cw, cw};
+		std::vector<uint8_t> out(w * h * 4);
+		
+		for(PixelFormat fmt : Formats) {
+			uint8_t* dst[] = {&out[0], NULL, NULL};
+			int dstStride[] = {w * (fmt == PIX_FMT_RGB24 ? 3 : 4), 0, 0};
+			printf("%dx%d\t%s", w, h, fmt == PIX_FMT_RGB24 ? "rgb24" : fmt == PIX_FMT_RGBA ? "rgba" : "bgra");
+			
+			for(ColorConverter::Kernel k : Kernels) {
+				ColorConverter* converter = ColorConverter::create(PIX_FMT_YUV420P, fmt, w, h, AVCOL_SPC_BT709, false, k);
+				// asked for more than the cpu has
+				if(!converter || converter->getKernel() != k) {
+					printf("\t-");
+					delete converter;
+					continue;
+				}
+				
+				int frames = 0;
+				double elapsed = 0.0;
+				auto start = std::chrono::steady_clock::now();
+				while(elapsed < MinTime) {
+					converter->convert(src, srcStride, dst, dstStride, 0, h);
+					frames++;
+					elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				}
+				printf("\t%.3f", elapsed * 1000.0 / frames);
+				delete converter;
+			}
+			printf("\n");
+		}
+	}
+}
+
+// the locked list packets were queued in before the ring, to race it against
+class ListQueue {
+public:
+	ListQueue() : bytes(0) {}
+	
+	void push(AVPacket pkt) {
+		av_dup_packet(&pkt);
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		packets.push_back(pkt);
+		bytes += pkt.size;
+		available.notify_one();
+	}
+	
+	void pop(AVPacket* pkt) {
+		std::unique_lock<std::mutex> lock(mutex);
+		available.wait(lock, [this]() { return !packets.empty(); });
+		*pkt = packets.front();
+		packets.pop_front();
+		bytes -= pkt->size;
+	}
+	
+private:
+	std::list<AVPacket> packets;
+	int64_t bytes;
+	std::mutex mutex;
+	std::condition_variable available;
+};
+
+// pushes count packets on one thread and pops them on another, through
+// the packet ring and the old locked list
+void queueBench(int count) {
+	using namespace jf;
+	
+	// no data to copy, only the queueing is timed
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 4096;
+	packet.duration = 1;
+	
+	auto run = [count](const std::function<void()>& produce, const std::function<void()>& consume) {
+		auto start = std::chrono::steady_clock::now();
+		std::thread producer(produce);
+		consume();
+		producer.join();
+		return count / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	
+	PacketQueue ring(NULL, AVRational{1, 1000});
+	double ringRate = run([&]() {
+		for(int i=0; i<count; i++)
+			while(!ring.push(packet))
+				std::this_thread::yield();
+	}, [&]() {
+		AVPacket p;
+		for(int i=0; i<count; i++) {
+			ring.pop(&p);
+			av_free_packet(&p);
+		}
+	});
+	
+	ListQueue list;
+	double listRate = run([&]() {
+		for(int i=0; i<count; i++)
+			list.push(packet);
+	}, [&]() {
+		AVPacket p;
+		for(int i=0; i<count; i++) {
+			list.pop(&p);
+			av_free_packet(&p);
+		}
+	});
+	
+	printf("queue\tpackets\tpackets/sec\n");
+	printf("ring\t%d\t%.0f\n", count, ringRate);
+	printf("list\t%d\t%.0f\n", count, listRate);
+	printf("ring is %.2fx the list\n", ringRate / listRate);
+}
+
+// writes <movie>.seekindex for each movie that doesn't have a current one
+int buildIndexes(int count, char* paths[]) {
+	using namespace jf;
+	int failed = 0;
+	for(int i=0; i<count; i++) {
+		printf("%s\n", paths[i]);
+		Demuxer* demuxer = Demuxer::open(paths[i], Demuxer::UseSeekIndex | Demuxer::ScanKeyframes | Demuxer::WriteSeekIndex);
+		if(!demuxer) {
+			printf("couldn't open %s\n", paths[i]);
+			failed++;
+		}
+		delete demuxer;
+	}
+	return failed ? 1 : 0;
+}
+
+// draws count copies of the movie in a grid, first as that many players and
+// then as one wall, and prints what a frame of each costs
+void wallReport(const char* path, int count, SDL_Window* win, jf::Program& yuvProg, int width, int height) {
+	using namespace jf;
+	static const int Frames = 300;
+	
+	float aspect = height / (float)width;
+	int cols = (int)std::ceil(std::sqrt((double)count));
+	int rows = (count + cols - 1) / cols;
+	float cellWidth = 1.f / cols;
+	float cellHeight = aspect / rows;
+	int tileWidth = width / cols;
+	int tileHeight = height / rows;
+	
+	// cpu time the draws take, and the binds they get past the state cache
+	auto measure = [&](const std::function<void(double)>& drawAll, double* cpuMs, double* binds) {
+		GLState::current().resetProfile();
+		auto begin = std::chrono::steady_clock::now();
+		double cpu = 0.0;
+		for(int f=0; f<Frames; f++) {
+			SDL_PumpEvents();
+			glClear(GL_COLOR_BUFFER_BIT);
+			
+			auto start = std::chrono::steady_clock::now();
+			drawAll(std::chrono::duration<double>(start - begin).count());
+			cpu += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			
+			SDL_GL_SwapWindow(win);
+			GLState::current().endFrame();
+		}
+		
+		GLState::Profile profile = GLState::current().getProfile();
+		int64_t issued = 0;
+		for(int i=0; i<GLState::CallCount; i++)
+			issued += profile.issued[i];
+		*cpuMs = cpu * 1000.0 / Frames;
+		*binds = issued / (double)std::max<int64_t>(1, profile.frames);
+	};
+	
+	std::vector<MoviePlayer*> players;
+	for(int i=0; i<count; i++) {
+		MoviePlayer* player = new MoviePlayer();
+		player->setYUVProgram(&yuvProg);
+		player->setDisplaySize(tileWidth, tileHeight);
+		player->setDecodeAhead(2);
+		player->setGopCacheBudget(0);
+		if(!player->open(path)) {
+			delete player;
+			break;
+		}
+		player->setRect((i % cols) * cellWidth, (i / cols) * cellHeight, cellWidth, cellHeight);
+		player->play();
+		players.push_back(player);
+	}
+	if(players.empty()) {
+		printf("couldn't open %s\n", path);
+		return;
+	}
+	
+	double playerMs, playerBinds;
+	measure([&](double) {
+		for(MoviePlayer* player : players)
+			player->draw();
+	}, &playerMs, &playerBinds);
+	for(MoviePlayer* player : players)
+		delete player;
+	
+	Program wallProg;
+	wallProg.addSource(GL_VERTEX_SHADER, readFile("resources/wall.vert"));
+	wallProg.addSource(GL_FRAGMENT_SHADER, readFile("resources/wall.frag"));
+	wallProg.create();
+	wallProg.compile();
+	wallProg.link({{"color",0}}, {{"corner",0},{"rect",1},{"layer",2}});
+	wallProg.bind();
+	wallProg.setUniform(wallProg.getUniformLocation("viewMatrix"), glm::mat4(1.f));
+	wallProg.setUniform(wallProg.getUniformLocation("projectionMatrix"), glm::ortho(0.f,1.f,0.f,aspect,-1.f,1.f));
+	
+	std::vector<Demuxer*> demuxers;
+	std::vector<VideoDecoder*> decoders;
+	for(int i=0; i<(int)players.size(); i++) {
+		Demuxer* demuxer = Demuxer::open(path, Demuxer::UseSeekIndex, StreamSelection().setAudio(false));
+		VideoDecoder* decoder = demuxer ? VideoDecoder::open(demuxer, DecoderOptions().setMaxSize(tileWidth, tileHeight)) : NULL;
+		if(!decoder) {
+			delete demuxer;
+			break;
+		}
+		decoder->setOutputFormat(VideoDecoder::OutputYUV);
+		decoder->setOutputSize(tileWidth, tileHeight);
+		decoder->setDecodeAhead(2);
+		demuxers.push_back(demuxer);
+		decoders.push_back(decoder);
+	}
+	
+	VideoWall* wall = decoders.empty() ? NULL : VideoWall::create(&wallProg, decoders[0]->getWidth(), decoders[0]->getHeight(), (int)decoders.size());
+	double wallMs = 0.0, wallBinds = 0.0, wallCalls = 0.0;
+	if(wall) {
+		for(int i=0; i<(int)decoders.size(); i++) {
+			int tile = wall->add(decoders[i]);
+			wall->setRect(tile, (i % cols) * cellWidth, (i / cols) * cellHeight, cellWidth, cellHeight);
+		}
+		measure([&](double time) { wall->draw(time); }, &wallMs, &wallBinds);
+		VideoWall::Stats stats = wall->getStats();
+		wallCalls = stats.drawCalls / (double)std::max<int64_t>(1, stats.frames);
+	}
+	else
+		printf("couldn't make a wall of %d\n", (int)players.size());
+	
+	printf("%d movies at %dx%d, %d frames\n", (int)players.size(), tileWidth, tileHeight, Frames);
+	printf("\tdraw calls/frame\tcpu ms/frame\tgl binds/frame\n");
+	printf("players\t%d\t%f\t%f\n", (int)players.size(), playerMs, playerBinds);
+	if(wall)
+		printf("wall\t%.1f\t%f\t%f\n", wallCalls, wallMs, wallBinds);
+	
+	delete wall;
+	for(VideoDecoder* decoder : decoders)
+		delete decoder;
+	for(Demuxer* demuxer : demuxers)
+		delete demuxer;
+	wallProg.destroy();
+}
+
 int main(int argc, char *argv[]) {
+	// movieplayer --decode-report movie.mov
+	if(argc > 2 && std::string(argv[1]) == "--decode-report") {
+		decodeReport(argv[2]);
+		return 0;
+	}
+	
+	// movieplayer --convert-report
+	if(argc > 1 && std::string(argv[1]) == "--convert-report") {
+		convertReport();
+		return 0;
+	}
+	
+	// movieplayer --queue-bench [packets]
+	if(argc > 1 && std::string(argv[1]) == "--queue-bench") {
+		queueBench(argc > 2 ? std::max(1, atoi(argv[2])) : 1000000);
+		return 0;
+	}
+	
+	// movieplayer --build-index movie.mov ...
+	if(argc > 2 && std::string(argv[1]) == "--build-index")
+		return buildIndexes(argc - 2, argv + 2);
+	
 	chdir("../../../");
 	
 	SDL_Init(SDL_INIT_VIDEO);
@@ -68,6 +410,30 @@ int main(int argc, char *argv[]) {
 	int projLoc = prog.getUniformLocation("projectionMatrix");
 	prog.setUniform(projLoc, glm::ortho(0.f,1.f,0.f,aspect,-1.f,1.f));
 	
+	// movies draw their yuv planes with this one, converting colour on the gpu
+	Program yuvProg;
+	yuvProg.addSource(GL_VERTEX_SHADER, readFile("resources/basic.vert"));
+	yuvProg.addSource(GL_FRAGMENT_SHADER, readFile("resources/yuv.frag"));
+	yuvProg.create();
+	yuvProg.compile();
+	yuvProg.link({{"color",0}}, {{"position",0},{"texCoords",1}});
+	yuvProg.bind();
+	yuvProg.setUniform(yuvProg.getUniformLocation("viewMatrix"), glm::mat4(1.f));
+	
+	int yuvProjLoc = yuvProg.getUniformLocation("projectionMatrix");
+	yuvProg.setUniform(yuvProjLoc, glm::ortho(0.f,1.f,0.f,aspect,-1.f,1.f));
+	prog.bind();
+	
+	// movieplayer --wall-report resources/movie.mov [count], from the project directory
+	if(argc > 2 && std::string(argv[1]) == "--wall-report") {
+		wallReport(argv[2], argc > 3 ? std::max(1, atoi(argv[3])) : 16, win, yuvProg, width, height);
+		prog.destroy();
+		yuvProg.destroy();
+		SDL_GL_DeleteContext(ctx);
+		SDL_DestroyWindow(win);
+		return 0;
+	}
+	
 	jf::AudioPlayer audio;
 	if(audio.open("resources/audio_loop2.m4a")) {
 		audio.setLooping(true);
@@ -75,6 +441,9 @@ int main(int argc, char *argv[]) {
 	}
 	
 	jf::MoviePlayer movie;
+	movie.setYUVProgram(&yuvProg);
+	// the rect below fills the window
+	movie.setDisplaySize(width, height);
 	if(movie.open("resources/real.mov")) {
 		movie.setRect(0,0,1,aspect);
 	}
@@ -91,8 +460,12 @@ int main(int argc, char *argv[]) {
 							height = event.window.data2;
 							aspect = height / (float)width;
 							glViewport(0, 0, width, height);
+							yuvProg.bind();
+							yuvProg.setUniform(yuvProjLoc, glm::ortho(0.f,1.f,0.f,aspect,-1.f,1.f));
+							prog.bind();
 							prog.setUniform(projLoc, glm::ortho(0.f,1.f,0.f,aspect,-1.f,1.f));
 							movie.setRect(0,0,1,aspect);
+							movie.setDisplaySize(width, height);
 							break;
 					}
 					break;
@@ -114,9 +487,29 @@ int main(int argc, char *argv[]) {
 								movie.play();
 							
 							break;
+							
+						case SDLK_r:
+							movie.playReverse();
+							break;
+							
+						case SDLK_UP:
+							movie.setRate(movie.getRate() * 2.f);
+							printf("playing at %.2fx\n", movie.getRate());
+							break;
+							
+						case SDLK_DOWN:
+							movie.setRate(movie.getRate() * 0.5f);
+							printf("playing at %.2fx\n", movie.getRate());
+							break;
 					}
 					break;
 					
+				// drag across the window to scrub
+				case SDL_MOUSEMOTION:
+					if(event.motion.state & SDL_BUTTON_LMASK)
+						movie.scrub(std::max(0, event.motion.x) / (float)width * movie.getDuration());
+					break;
+					
 				case SDL_QUIT:
 					done = true;
 					break;
@@ -128,9 +521,20 @@ int main(int argc, char *argv[]) {
 		movie.draw();
 		
 		SDL_GL_SwapWindow(win);
+		jf::GLState::current().endFrame();
+	}
+	
+	// binds the state cache let through to the driver and the ones it saved
+	jf::GLState::Profile profile = jf::GLState::current().getProfile();
+	if(profile.frames > 0) {
+		printf("gl state:\n");
+		for(int i=0; i<jf::GLState::CallCount; i++)
+			printf("\t%s: %.1f issued, %.1f skipped per frame\n", jf::GLState::getCallName((jf::GLState::Call)i),
+				   profile.issued[i] / (double)profile.frames, profile.skipped[i] / (double)profile.frames);
 	}
 	
 	prog.destroy();
+	yuvProg.destroy();
 	movie.close();
 	audio.close();
 	
@@ -8,6 +8,8 @@
 
 #include "movie.h"
 #include "decoder.h"
+#include "session.h"
+#include "convert.h"
 
 #include <list>
 #include <mutex>
@@ -15,37 +17,119 @@
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <chrono>
 
 #include <SDL.h>
 
 namespace jf {
 	
-	bool uploadFrame(Buffer pbo, Texture tex, VideoFrame::Ptr frame) {
+	#define BUFFER_OFFSET(i) (char*)NULL + i
+	
+	// hands the decoder buffers the ring has mapped ahead of time
+	class RingTarget : public FrameTarget {
+	public:
+		RingTarget(PixelBufferRing& r) : ring(r) {}
+		int acquire(int size, uint8_t** bytes) { return ring.acquire(size, bytes); }
+		void release(int id) { ring.release(id); }
+		
+	private:
+		PixelBufferRing& ring;
+	};
+	
+	// with a ring the frame is either in one of its buffers already or goes
+	// into the next free one, and the textures are updated in place.
+	// otherwise the one pbo and the textures are reallocated every frame
+	bool uploadFrame(Buffer pbo, PixelBufferRing& ring, Texture* textures, VideoFrame::Ptr frame) {
 		if(!frame)
 			return false;
 		
-		tex.bind();
+		bool inPlace = true;
+		if(frame->targetId >= 0)
+			ring.bindAcquired(frame->targetId);
+		else if(void* mapped = ring ? ring.map(frame->numBytes) : NULL) {
+			memcpy(mapped, frame->bytes, frame->numBytes);
+			ring.unmap();
+		}
+		else {
+			// no ring, or frames decoded ahead are holding all of it
+			inPlace = false;
+			pbo.bind();
+			pbo.upload(frame->numBytes, frame->bytes);
+		}
 		
-		pbo.bind();
-		pbo.upload(frame->numBytes, frame->bytes);
+		// yuv planes are tightly packed
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 		
-		tex.upload(frame->width, frame->height, GL_RGB, 0);
-		pbo.unbind();
+		for(int i=0; i<frame->numPlanes; i++) {
+			GLenum uploadFormat = GL_RED;
+			GLenum internalFormat = GL_R8;
+			switch(frame->format) {
+				case PIX_FMT_RGB24: uploadFormat = GL_RGB; internalFormat = GL_RGB; break;
+				case PIX_FMT_RGBA: uploadFormat = GL_RGBA; internalFormat = GL_RGBA8; break;
+				case PIX_FMT_BGRA: uploadFormat = GL_BGRA; internalFormat = GL_RGBA8; break;
+				case PIX_FMT_NV12:
+					if(i == 1) {
+						uploadFormat = GL_RG;
+						internalFormat = GL_RG8;
+					}
+					break;
+				default: break;
+			}
+			
+			Texture& tex = textures[i];
+			tex.format = internalFormat;
+			
+			// on the unit it's drawn from, so drawing doesn't have to bind it again
+			Texture::setActiveUnit(i);
+			tex.bind();
+			if(inPlace)
+				tex.update(frame->planeWidths[i], frame->planeHeights[i], uploadFormat, (const GLubyte*)BUFFER_OFFSET(frame->planeOffsets[i]));
+			else
+				tex.upload(frame->planeWidths[i], frame->planeHeights[i], uploadFormat, (const GLubyte*)BUFFER_OFFSET(frame->planeOffsets[i]));
+		}
+		Texture::setActiveUnit(0);
 		
-		tex.generateMipMaps();
-		tex.unbind();
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		if(inPlace)
+			ring.fence();
+		else
+			pbo.unbind();
 		
 		return true;
 	}
 	
+	// mips only get sampled, and rebuilt, when the picture is drawn small
+	TextureParameters videoTextureParameters(bool mipmapped) {
+		return TextureParameters()
+			.setFilters(mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR, GL_LINEAR)
+			.setLevels(0, 10);
+	}
+	
 	MoviePlayer::MoviePlayer()
 	:	demuxer(NULL)
 	,	videoDecoder(NULL)
 	,	audioDecoder(NULL)
+	,	session(NULL)
 	,	state(Stopped)
-	,	playStartTime(0)
-	,	pauseStartTime(0)
-	,	pauseElapsedTime(0)
+	,	decodeAhead(4)
+	,	convertSlices(0)
+	,	gopCacheBudget(256 * 1024 * 1024)
+	,	displayWidth(0)
+	,	displayHeight(0)
+	,	uploadBuffers(3)
+	,	uploadStats()
+	,	frameTarget(NULL)
+	,	sampling(Mipmapped)
+	,	mipsStale(true)
+	,	yuvProgram(NULL)
+	,	planeCount(1)
+	,	interleavedChroma(false)
+	,	clock(MasterClock::Video)
+	,	masterClock(NULL)
+	,	syncStats()
+	,	reverseRate(1.f)
+	,	reverseFrom(0.0)
+	,	reverseStartTime(0)
 	{}
 	
 	MoviePlayer::~MoviePlayer() {
@@ -55,19 +139,53 @@ namespace jf {
 	bool MoviePlayer::open(const char* path) {
 		close();
 	
-		if(!(demuxer = Demuxer::open(path)))
+		// exact seeks from the start if somebody built an index. the audio
+		// belongs to an AudioPlayer, if anyone, so don't read it here too
+		if(!(demuxer = Demuxer::open(path, Demuxer::UseSeekIndex, StreamSelection().setAudio(false))))
 			return false;
 		
-		if(!(videoDecoder = VideoDecoder::open(demuxer)))
+		if(!(videoDecoder = VideoDecoder::open(demuxer, DecoderOptions().setMaxSize(displayWidth, displayHeight))))
 		   return false;
+		
+		return openOutput();
+	}
+	
+	bool MoviePlayer::open(MediaSession* s) {
+		close();
+		
+		if(!s || !(videoDecoder = s->getVideoDecoder()))
+			return false;
+		session = s;
+		demuxer = s->getDemuxer();
+		
+		return openOutput();
+	}
+	
+	bool MoviePlayer::openOutput() {
+		videoDecoder->setConvertSlices(convertSlices);
+		videoDecoder->setGopCacheBudget(gopCacheBudget);
+		videoDecoder->setOutputFormat(yuvProgram ? VideoDecoder::OutputYUV : VideoDecoder::OutputRGB);
+		videoDecoder->setOutputSize(displayWidth, displayHeight);
 
-		texture.create(GL_TEXTURE_2D, GL_RGB);
-		texture.configure(TextureParameters()
-						  .setFilters(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR)
-						  .setLevels(0, 10));
+		// draw() works out what's really needed once there's a frame
+		for(Texture& tex : textures) {
+			tex.create(GL_TEXTURE_2D, GL_RGB);
+			tex.configure(videoTextureParameters(true));
+		}
+		Texture::unbind(GL_TEXTURE_2D);
+		sampling = Mipmapped;
 		
 		pixelBuffer.create(GL_PIXEL_UNPACK_BUFFER, GL_STREAM_DRAW);
 		pixelBuffer.upload(videoDecoder->getBytesPerFrame(), NULL);
+		if(uploadBuffers > 0) {
+			// frames decoded ahead each hold a buffer until they're shown
+			int count = uploadBuffers + decodeAhead;
+			uploadRing.create(count);
+			uploadRing.prepare(videoDecoder->getBytesPerFrame());
+			frameTarget = new RingTarget(uploadRing);
+			videoDecoder->setFrameTarget(frameTarget);
+			printf("video upload: %d pbos, %s\n", count, uploadRing.isPersistent() ? "persistently mapped" : "orphaned on map");
+		}
 		
 		float verts[] = {
 			0,0, 0,1,
@@ -89,21 +207,50 @@ namespace jf {
 		
 		quad.unbind();
 
-		uploadFrame(pixelBuffer, texture, videoDecoder->nextFrame());
+		showFrame(videoDecoder->nextFrame());
+		videoDecoder->setDecodeAhead(decodeAhead);
 		
 		return true;
 	}
 	
 	void MoviePlayer::close() {
 		state = Stopped;
-		texture.destroy();
+		// frames still holding pixel buffers go before the buffers do
+		if(videoDecoder)
+			videoDecoder->setFrameTarget(NULL);
+		delete frameTarget;
+		frameTarget = NULL;
+		for(Texture& tex : textures)
+			tex.destroy();
+		if(uploadStats.uploads > 0) {
+			PixelBufferRing::Stats ring = uploadRing.getStats();
+			printf("video upload:\n\t%lld frames\n\t%f ms/frame\n\t%lld decoded straight into a pbo\n\t%lld waits on the gpu, %f ms\n\t%lld mip chains built\n",
+				   uploadStats.uploads, uploadStats.uploadTime * 1000.0 / uploadStats.uploads, ring.direct, ring.stalls, ring.stallTime * 1000.0,
+				   uploadStats.mipmaps);
+		}
+		uploadStats = UploadStats();
+		uploadRing.destroy();
 		pixelBuffer.destroy();
 		vao.destroy();
 		quad.destroy();
 		if(videoDecoder) {
-			delete videoDecoder;
+			static const char* sources[] = {"audio", "video", "external"};
+			SyncStats st = getSyncStats();
+			printf("video sync (%s clock):\n\t%f ms drift\n\t%f ms max drift\n\t%lld shown\n\t%lld dropped\n",
+				   sources[(masterClock ? masterClock : &clock)->getSource()],
+				   st.drift * 1000.0, st.maxDrift * 1000.0, st.shown, st.dropped);
+			
+			// the session's decoder isn't ours to delete
+			if(session) {
+				videoDecoder->setDecodeAhead(0);
+				demuxer = NULL;
+			}
+			else
+				delete videoDecoder;
 			videoDecoder = NULL;
 		}
+		session = NULL;
+		syncStats = SyncStats();
 		if(audioDecoder) {
 			delete audioDecoder;
 			audioDecoder = NULL;
@@ -115,62 +262,139 @@ namespace jf {
 	}
 	
 	void MoviePlayer::play() {
+		if(videoDecoder)
+			videoDecoder->setPlaybackRate(clock.getRate());
+		
+		if(videoDecoder && videoDecoder->isReverse()) {
+			stopReverse();
+			state = Playing;
+			return;
+		}
+		
 		if(state != Playing) {
 			switch(state) {
 				case Stopped:
 					videoDecoder->seekToFrame(0);
-					playStartTime = SDL_GetTicks();
-					pauseElapsedTime = 0;
-					break;
-					
-				case Paused:
-					pauseElapsedTime += (SDL_GetTicks() - pauseStartTime);
+					clock.setTime(0.0);
 					break;
 					
 				default:
 					break;
 			}
 			
+			clock.resume();
 			state = Playing;
 		}
 	}
 	
+	void MoviePlayer::playReverse(float rate) {
+		if(!videoDecoder || rate <= 0.f)
+			return;
+		
+		// needs the gop cache, there's no going backwards without it
+		videoDecoder->setReverse(true);
+		if(!videoDecoder->isReverse())
+			return;
+		
+		reverseRate = rate;
+		reverseFrom = videoDecoder->getCurrentTime();
+		reverseStartTime = SDL_GetTicks();
+		state = Playing;
+	}
+	
+	void MoviePlayer::stopReverse() {
+		videoDecoder->setReverse(false);
+		clock.setTime(videoDecoder->getCurrentTime());
+	}
+	
+	void MoviePlayer::setRate(float r) {
+		clock.setRate(std::max(0.25f, std::min(16.f, r)));
+		if(videoDecoder) {
+			// carry on from the frame on screen at the new speed
+			clock.setTime(videoDecoder->getCurrentTime());
+			if(state == Playing && !videoDecoder->isReverse())
+				videoDecoder->setPlaybackRate(clock.getRate());
+		}
+	}
+	
+	float MoviePlayer::getRate() const { return clock.getRate(); }
+	
+	void MoviePlayer::setMasterClock(const MasterClock* c) { masterClock = c; }
+	const MasterClock& MoviePlayer::getClock() const { return clock; }
+	
+	MoviePlayer::SyncStats MoviePlayer::getSyncStats() const {
+		SyncStats st = syncStats;
+		if(videoDecoder) {
+			VideoDecoder::DecodeStats decode = videoDecoder->getDecodeStats();
+			st.shown = decode.shown;
+			st.dropped = decode.dropped + decode.overtaken;
+		}
+		return st;
+	}
+	
 	void MoviePlayer::pause() {
+		// stepping around while paused wants every frame
+		if(videoDecoder) {
+			videoDecoder->setPlaybackRate(1.0);
+			videoDecoder->setLateTime(-1.0);
+		}
+		
+		if(videoDecoder && videoDecoder->isReverse()) {
+			stopReverse();
+			clock.pause();
+			state = Paused;
+			return;
+		}
+		
 		if(state != Paused) {
-			switch(state) {
-				case Playing:
-					pauseStartTime = SDL_GetTicks();
-					break;
-					
-				default:
-					break;
-			}
-			
+			clock.pause();
 			state = Paused;
 		}
 	}
 	
 	void MoviePlayer::stop() {
+		if(videoDecoder && videoDecoder->isReverse())
+			stopReverse();
+		
 		if(state != Stopped) {
+			clock.pause();
 			state = Stopped;
 		}
 	}
 	
 	void MoviePlayer::seek(float time) {
-		videoDecoder->seekToTime(time);
+		if(!videoDecoder)
+			return;
+		
+		if(videoDecoder->isReverse())
+			stopReverse();
+		if(session)
+			session->seekToTime(time);
+		else
+			videoDecoder->seekToTime(time);
+		
+		// play on from wherever it lands
+		clock.setTime(std::max(0.f, time));
+	}
+	
+	void MoviePlayer::scrub(float time) {
+		if(videoDecoder) {
+			pause();
+			showFrame(videoDecoder->scrubToTime(time));
+		}
 	}
 	
 	void MoviePlayer::previousFrame() {
 		if(videoDecoder) {
 			pause();
-			uploadFrame(pixelBuffer, texture, videoDecoder->previousFrame());
+			showFrame(videoDecoder->previousFrame());
 		}
 	}
 	
 	void MoviePlayer::nextFrame() {
 		if(videoDecoder && state != Complete) {
 			pause();
-			if(!uploadFrame(pixelBuffer, texture, videoDecoder->nextFrame())) {
+			if(!showFrame(videoDecoder->nextFrame())) {
 				if(videoDecoder->isLastFrame()) {
 					state = Complete;
 				}
@@ -178,6 +402,107 @@ namespace jf {
 		}
 	}
 	
+	void MoviePlayer::setDecodeAhead(int frames) {
+		decodeAhead = frames;
+		if(videoDecoder)
+			videoDecoder->setDecodeAhead(frames);
+	}
+	
+	void MoviePlayer::setConvertSlices(int slices) {
+		convertSlices = slices;
+		if(videoDecoder)
+			videoDecoder->setConvertSlices(slices);
+	}
+	
+	void MoviePlayer::setGopCacheBudget(int64_t bytes) {
+		gopCacheBudget = bytes;
+		if(videoDecoder)
+			videoDecoder->setGopCacheBudget(bytes);
+	}
+	
+	void MoviePlayer::setUploadBuffers(int count) {
+		// takes effect at the next open, the textures are set up for one or the other
+		uploadBuffers = std::max(0, count);
+	}
+	
+	MoviePlayer::UploadStats MoviePlayer::getUploadStats() const { return uploadStats; }
+	
+	void MoviePlayer::setDisplaySize(int w, int h) {
+		displayWidth = w;
+		displayHeight = h;
+		if(videoDecoder)
+			videoDecoder->setOutputSize(w, h);
+	}
+	
+	void MoviePlayer::setYUVProgram(Program* program) {
+		yuvProgram = program;
+		if(videoDecoder)
+			videoDecoder->setOutputFormat(yuvProgram ? VideoDecoder::OutputYUV : VideoDecoder::OutputRGB);
+	}
+	
+	bool MoviePlayer::showFrame(VideoFrame::Ptr frame) {
+		auto start = std::chrono::steady_clock::now();
+		if(!uploadFrame(pixelBuffer, uploadRing, textures, frame))
+			return false;
+		uploadStats.uploads++;
+		uploadStats.uploadTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		mipsStale = true;
+		
+		// remember how to draw what's now in the textures
+		planeCount = frame->numPlanes;
+		interleavedChroma = frame->format == PIX_FMT_NV12;
+		if(planeCount > 1)
+			yuvToRgb(frame->colorSpace, frame->fullRange, frame->height, yuvMatrix, yuvOffset);
+		
+		return true;
+	}
+	
+	MoviePlayer::Sampling MoviePlayer::chooseSampling() const {
+		int texWidth = textures[0].width;
+		int texHeight = textures[0].height;
+		// no idea how big it's drawn, play safe
+		if(displayWidth <= 0 || displayHeight <= 0 || texWidth <= 0 || texHeight <= 0)
+			return Mipmapped;
+		
+		// the picture is fit inside the display rect
+		float scale = std::min(displayWidth / (float)texWidth, displayHeight / (float)texHeight);
+		if(scale >= 0.999f)
+			return Native;
+		// the rgb path draws with the caller's program, it can't filter
+		if(scale >= 0.5f && planeCount > 1 && yuvProgram)
+			return Filtered;
+		return Mipmapped;
+	}
+	
+	void MoviePlayer::updateSampling() {
+		Sampling want = chooseSampling();
+		if(want != sampling) {
+			// every plane's texture, an rgb frame only uses the first but the
+			// rest have to match if a yuv one comes along
+			for(int i=0; i<3; i++) {
+				Texture::setActiveUnit(i);
+				textures[i].bind();
+				textures[i].configure(videoTextureParameters(want == Mipmapped));
+			}
+			Texture::setActiveUnit(0);
+			sampling = want;
+			if(want == Mipmapped)
+				mipsStale = true;
+		}
+		
+		// only the frames that get drawn small pay for mips
+		if(sampling == Mipmapped && mipsStale) {
+			for(int i=0; i<planeCount; i++) {
+				Texture::setActiveUnit(i);
+				textures[i].bind();
+				textures[i].generateMipMaps();
+			}
+			Texture::setActiveUnit(0);
+			uploadStats.mipmaps++;
+		}
+		mipsStale = false;
+	}
+	
 	bool MoviePlayer::isPlaying() const {
 		return state == Playing;
 	}
@@ -193,6 +518,12 @@ namespace jf {
 	bool MoviePlayer::isFinished() const {
 		return state == Complete;
 	}
+	
+	double MoviePlayer::getDuration() const {
+		if(!demuxer || demuxer->getFormat()->duration == AV_NOPTS_VALUE)
+			return 0.0;
+		return demuxer->getFormat()->duration / (double)AV_TIME_BASE;
+	}
 
 	void MoviePlayer::setRect(float x, float y, float w, float h) {
 		if(videoDecoder) {
@@ -234,18 +565,67 @@ namespace jf {
 
 	void MoviePlayer::draw() {
 		if(videoDecoder) {
-			double elapsed = (SDL_GetTicks() - playStartTime - pauseElapsedTime) / 1000.0;
-			double target = videoDecoder->getNextTime();
+			// buffers the gpu is done with get mapped again for the decoder
+			if(frameTarget)
+				uploadRing.prepare(videoDecoder->getBytesPerFrame());
 			
-			if(state == Playing && elapsed >= target) {
-				uploadFrame(pixelBuffer, texture, videoDecoder->nextFrame());
+			double elapsed = masterClock ? masterClock->getTime() : clock.getTime();
+			
+			if(state == Playing && videoDecoder->isReverse()) {
+				double time = reverseFrom - (SDL_GetTicks() - reverseStartTime) / 1000.0 * reverseRate;
+				showFrame(videoDecoder->reverseFrameForTime(std::max(0.0, time)));
+				
+				// back at the start
+				if(time <= 0.0)
+					pause();
+			}
+			else if(state == Playing) {
+				// anything that would finish before now isn't worth converting
+				videoDecoder->setLateTime(elapsed);
+				VideoFrame::Ptr frame = videoDecoder->frameForTime(elapsed);
+				if(showFrame(frame)) {
+					syncStats.drift = elapsed - frame->outTime;
+					syncStats.maxDrift = std::max(syncStats.maxDrift, std::fabs(syncStats.drift));
+				}
+			}
+			else if(videoDecoder->isScrubbing()) {
+				showFrame(videoDecoder->refineScrub());
 			}
+			else if(videoDecoder->isSeeking()) {
+				// paused, but the seek still needs to show where it went
+				showFrame(videoDecoder->frameForTime(videoDecoder->getCurrentTime()));
+			}
+			
+			updateSampling();
 			
-			texture.bind();
-			vao.bind();
-			glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-			vao.unbind();
-			texture.unbind();
+			// the textures and vertex array stay bound, each plane on its own
+			// unit, so the next frame's binds are skipped by the state cache
+			if(planeCount > 1 && yuvProgram) {
+				// put back whatever program the caller had bound
+				ScopedBind program(*yuvProgram);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("yTex"), 0);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("uTex"), 1);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("vTex"), 2);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("interleaved"), interleavedChroma ? 1 : 0);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("yuvMatrix"), yuvMatrix);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("yuvOffset"), yuvOffset);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("filtered"), sampling == Filtered ? 1 : 0);
+				yuvProgram->setUniform(yuvProgram->getUniformLocation("texelSize"), glm::vec2(1.f / textures[0].width, 1.f / textures[0].height));
+				
+				for(int i=0; i<planeCount; i++) {
+					Texture::setActiveUnit(i);
+					textures[i].bind();
+				}
+				Texture::setActiveUnit(0);
+				
+				vao.bind();
+				glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+			}
+			else {
+				textures[0].bind();
+				vao.bind();
+				glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+			}
 		}
 	}
 }
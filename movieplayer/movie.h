@@ -9,24 +9,54 @@
 #pragma once
 
 #include "render.h"
+#include "clock.h"
+
+#include <memory>
 
 namespace jf {
 	
 	class Demuxer;
+	class MediaSession;
 	class VideoDecoder;
 	class AudioDecoder;
+	class FrameTarget;
+	struct VideoFrame;
 	
 	class MoviePlayer {
 	public:
+		// how far the picture is from the master clock, positive is behind
+		struct SyncStats {
+			double drift, maxDrift;
+			int64_t shown, dropped;
+		};
+		
+		// cpu time from a decoded frame to the texture calls being issued,
+		// and how many of them were drawn small enough to need mips
+		struct UploadStats {
+			int64_t uploads;
+			double uploadTime;
+			int64_t mipmaps;
+		};
+		
 		MoviePlayer();
 		~MoviePlayer();
 
 		bool open(const char* path);
+		// shows the session's video, which stays the session's. seeks move
+		// the session's audio along with it
+		bool open(MediaSession* session);
 		void close();
 		void play();
+		// backwards from the current frame, rate times real time. stalls
+		// rather than blowing the GOP cache budget if decoding can't keep up
+		void playReverse(float rate=1.f);
 		void pause();
 		void stop();
+		// doesn't wait for the decoder, a newer seek replaces one still underway
 		void seek(float sec);
+		// pauses and shows the keyframe nearest sec, the exact frame follows
+		// once the scrubbing stops
+		void scrub(float sec);
 		void previousFrame();
 		void nextFrame();
 		
@@ -34,14 +64,64 @@ namespace jf {
 		bool isPaused() const;
 		bool isStopped() const;
 		bool isFinished() const;
+		double getDuration() const;
+		
+		// 0.25x to 16x. fast enough and the decoder skips frames that would
+		// never get shown rather than decoding them
+		void setRate(float rate);
+		float getRate() const;
+		
+		// frames follow clock instead of the player's own, which the caller
+		// keeps running and alive. NULL goes back to the player's own clock
+		void setMasterClock(const MasterClock* clock);
+		// the player's own timeline, for slaving something else to the video
+		const MasterClock& getClock() const;
+		SyncStats getSyncStats() const;
+		
+		// number of frames decoded ahead of the render loop, 0 decodes inline
+		void setDecodeAhead(int frames);
+		// bands each frame is colour converted in across the worker pool, 0 is one per core
+		void setConvertSlices(int slices);
+		// memory for decoded frames kept around for stepping backwards, 0 turns it off
+		void setGopCacheBudget(int64_t bytes);
+		// with a program (basic.vert + yuv.frag) frames stay in YUV and are
+		// colour converted on the gpu, NULL goes back to cpu converted RGB
+		void setYUVProgram(Program* program);
+		// pbos frames are uploaded through in turn, the decoder converts
+		// straight into them when one is free. frames decoded ahead hold one
+		// each on top of these. 0 reuses a single one and reallocates it and
+		// the textures every frame. takes effect at open
+		void setUploadBuffers(int count);
+		UploadStats getUploadStats() const;
 		
 		void setRect(float x, float y, float w, float h);
+		// pixels the rect covers on screen, frames are decoded and uploaded
+		// no bigger than the picture drawn in it. 0 for full size. set before
+		// open() and codecs that can decode at reduced size do that too.
+		// also decides whether the textures need mips at all
+		void setDisplaySize(int width, int height);
 		void draw();
 		
 	private:
+		// gets the decoder ready and everything it draws with
+		bool openOutput();
+		bool showFrame(std::shared_ptr<VideoFrame> frame);
+		
+		// how the textures are sampled for the size they're drawn at
+		enum Sampling {
+			Native,		// at or above the frame's size, plain bilinear
+			Filtered,	// shrunk by up to half, yuv.frag averages four taps
+			Mipmapped	// anything smaller, mips built for each new frame drawn
+		};
+		Sampling chooseSampling() const;
+		void updateSampling();
+		// forward time picks up from wherever reverse got to
+		void stopReverse();
+		
 		Demuxer* demuxer;
 		VideoDecoder* videoDecoder;
 		AudioDecoder* audioDecoder;
+		MediaSession* session;
 		
 		enum {
 			Playing,
@@ -50,11 +130,36 @@ namespace jf {
 			Complete
 		} state;
 		
-		uint32_t playStartTime;
-		uint32_t pauseStartTime, pauseElapsedTime;
+		int decodeAhead;
+		int convertSlices;
+		int64_t gopCacheBudget;
+		int displayWidth, displayHeight;
+		
+		ExternalClock clock;
+		const MasterClock* masterClock;
+		SyncStats syncStats;
 		
-		Texture texture;
+		float reverseRate;
+		double reverseFrom;
+		uint32_t reverseStartTime;
+		
+		// rgb, or one per yuv plane
+		Texture textures[3];
 		Buffer pixelBuffer;
+		PixelBufferRing uploadRing;
+		int uploadBuffers;
+		UploadStats uploadStats;
+		// hands the decoder buffers from uploadRing
+		FrameTarget* frameTarget;
+		Sampling sampling;
+		// a frame's been uploaded since the mips were built
+		bool mipsStale;
+		
+		Program* yuvProgram;
+		int planeCount;
+		bool interleavedChroma;
+		glm::mat3 yuvMatrix;
+		glm::vec3 yuvOffset;
 
 		VertexArray vao;
 		Buffer quad;
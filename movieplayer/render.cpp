@@ -8,12 +8,16 @@
 
 #include "render.h"
 
+#include <chrono>
+#include <algorithm>
+
 namespace jf {
 	
 	using std::map;
 	using glm::vec2;
 	using glm::vec3;
 	using glm::vec4;
+	using glm::mat3;
 	using glm::mat4;
 	
 	#define BUFFER_OFFSET(i) (char*)NULL + i
@@ -35,6 +39,236 @@ namespace jf {
 		{GL_FRAGMENT_SHADER, "fragment"}
 	};
 	
+	static GLState defaultState;
+	static GLState* currentState = &defaultState;
+	
+	GLState::GLState()
+	:	activeUnit(-1)
+	,	vertexArray(Unknown)
+	,	program(Unknown)
+	,	profile()
+	{}
+	
+	GLState& GLState::current() {
+		return *currentState;
+	}
+	
+	void GLState::makeCurrent() {
+		currentState = this;
+	}
+	
+	bool GLState::change(Call call, GLuint& bound, GLuint uid) {
+		if(bound == uid) {
+			profile.skipped[call]++;
+			return false;
+		}
+		profile.issued[call]++;
+		bound = uid;
+		return true;
+	}
+	
+	void GLState::bindBuffer(GLenum target, GLuint uid) {
+		auto it = buffers.insert(std::make_pair(target, (GLuint)Unknown)).first;
+		if(change(BindBuffer, it->second, uid))
+			glBindBuffer(target, uid);
+	}
+	
+	void GLState::bindTexture(GLenum target, GLuint uid) {
+		// the first texture call a context makes is on unit 0
+		if(activeUnit < 0)
+			setActiveUnit(0);
+		auto it = textures.insert(std::make_pair(std::make_pair(activeUnit, target), (GLuint)Unknown)).first;
+		if(change(BindTexture, it->second, uid))
+			glBindTexture(target, uid);
+	}
+	
+	void GLState::setActiveUnit(int unit) {
+		if(unit == activeUnit) {
+			profile.skipped[ActiveTexture]++;
+			return;
+		}
+		profile.issued[ActiveTexture]++;
+		activeUnit = unit;
+		glActiveTexture(GL_TEXTURE0 + unit);
+	}
+	
+	void GLState::bindVertexArray(GLuint uid) {
+		if(change(BindVertexArray, vertexArray, uid)) {
+			glBindVertexArray(uid);
+			// the element buffer is part of the vertex array's state
+			buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+		}
+	}
+	
+	void GLState::useProgram(GLuint uid) {
+		if(change(UseProgram, program, uid))
+			glUseProgram(uid);
+	}
+	
+	GLuint GLState::getBuffer(GLenum target) const {
+		auto it = buffers.find(target);
+		return it != buffers.end() ? it->second : Unknown;
+	}
+	
+	GLuint GLState::getTexture(GLenum target) const {
+		auto it = textures.find(std::make_pair(activeUnit, target));
+		return it != textures.end() ? it->second : Unknown;
+	}
+	
+	int GLState::getActiveUnit() const { return activeUnit; }
+	GLuint GLState::getVertexArray() const { return vertexArray; }
+	GLuint GLState::getProgram() const { return program; }
+	
+	void GLState::forgetBuffer(GLuint uid) {
+		for(auto& bound : buffers)
+			if(bound.second == uid)
+				bound.second = 0;
+	}
+	
+	void GLState::forgetTexture(GLuint uid) {
+		for(auto& bound : textures)
+			if(bound.second == uid)
+				bound.second = 0;
+	}
+	
+	void GLState::forgetVertexArray(GLuint uid) {
+		if(vertexArray == uid) {
+			vertexArray = 0;
+			buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+		}
+	}
+	
+	void GLState::forgetProgram(GLuint uid) {
+		// a deleted program stays in use until another one is, so it's unknown
+		// rather than unbound
+		if(program == uid)
+			program = Unknown;
+	}
+	
+	void GLState::invalidate() {
+		buffers.clear();
+		textures.clear();
+		activeUnit = -1;
+		vertexArray = Unknown;
+		program = Unknown;
+	}
+	
+	void GLState::endFrame() {
+		profile.frames++;
+	}
+	
+	GLState::Profile GLState::getProfile() const {
+		return profile;
+	}
+	
+	void GLState::resetProfile() {
+		profile = Profile();
+	}
+	
+	const char* GLState::getCallName(Call call) {
+		switch(call) {
+			case BindBuffer: return "glBindBuffer";
+			case BindTexture: return "glBindTexture";
+			case ActiveTexture: return "glActiveTexture";
+			case BindVertexArray: return "glBindVertexArray";
+			case UseProgram: return "glUseProgram";
+			default: break;
+		}
+		return "unknown";
+	}
+	
+	// the cache's idea of what's bound, or GL's when it hasn't seen a bind
+	// yet. 0 for targets it has no query for
+	static GLuint boundBefore(GLState::Call call, GLenum target, GLuint cached) {
+		if(cached != GLState::Unknown)
+			return cached;
+		
+		GLenum query = 0;
+		switch(call) {
+			case GLState::BindBuffer:
+				switch(target) {
+					case GL_ARRAY_BUFFER: query = GL_ARRAY_BUFFER_BINDING; break;
+					case GL_ELEMENT_ARRAY_BUFFER: query = GL_ELEMENT_ARRAY_BUFFER_BINDING; break;
+					case GL_PIXEL_PACK_BUFFER: query = GL_PIXEL_PACK_BUFFER_BINDING; break;
+					case GL_PIXEL_UNPACK_BUFFER: query = GL_PIXEL_UNPACK_BUFFER_BINDING; break;
+					case GL_UNIFORM_BUFFER: query = GL_UNIFORM_BUFFER_BINDING; break;
+					default: break;
+				}
+				break;
+			case GLState::BindTexture:
+				switch(target) {
+					case GL_TEXTURE_2D: query = GL_TEXTURE_BINDING_2D; break;
+					case GL_TEXTURE_2D_ARRAY: query = GL_TEXTURE_BINDING_2D_ARRAY; break;
+					case GL_TEXTURE_3D: query = GL_TEXTURE_BINDING_3D; break;
+					case GL_TEXTURE_RECTANGLE: query = GL_TEXTURE_BINDING_RECTANGLE; break;
+					case GL_TEXTURE_CUBE_MAP: query = GL_TEXTURE_BINDING_CUBE_MAP; break;
+					default: break;
+				}
+				break;
+			case GLState::BindVertexArray: query = GL_VERTEX_ARRAY_BINDING; break;
+			case GLState::UseProgram: query = GL_CURRENT_PROGRAM; break;
+			default: break;
+		}
+		
+		GLint name = 0;
+		if(query)
+			glGetIntegerv(query, &name);
+		return (GLuint)name;
+	}
+	
+	ScopedBind::ScopedBind(Buffer& buffer)
+	:	call(GLState::BindBuffer)
+	,	target(buffer.target)
+	,	unit(0)
+	,	previous(boundBefore(call, target, GLState::current().getBuffer(buffer.target)))
+	{
+		buffer.bind();
+	}
+	
+	ScopedBind::ScopedBind(Texture& texture)
+	:	call(GLState::BindTexture)
+	,	target(texture.target)
+	,	unit(GLState::current().getActiveUnit())
+	,	previous(GLState::Unknown)
+	{
+		if(unit < 0) {
+			GLint active = GL_TEXTURE0;
+			glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+			unit = active - GL_TEXTURE0;
+		}
+		previous = boundBefore(call, target, GLState::current().getTexture(texture.target));
+		texture.bind();
+	}
+	
+	ScopedBind::ScopedBind(VertexArray& vertexArray)
+	:	call(GLState::BindVertexArray)
+	,	target(0)
+	,	unit(0)
+	,	previous(boundBefore(call, 0, GLState::current().getVertexArray()))
+	{
+		vertexArray.bind();
+	}
+	
+	ScopedBind::ScopedBind(Program& program)
+	:	call(GLState::UseProgram)
+	,	target(0)
+	,	unit(0)
+	,	previous(boundBefore(call, 0, GLState::current().getProgram()))
+	{
+		program.bind();
+	}
+	
+	ScopedBind::~ScopedBind() {
+		GLState& state = GLState::current();
+		switch(call) {
+			case GLState::BindBuffer: state.bindBuffer(target, previous); break;
+			case GLState::BindTexture: state.setActiveUnit(unit); state.bindTexture(target, previous); break;
+			case GLState::BindVertexArray: state.bindVertexArray(previous); break;
+			case GLState::UseProgram: state.useProgram(previous); break;
+			default: break;
+		}
+	}
+	
 	VertexArray::VertexArray()
 	:	uid(0)
 	{}
@@ -45,24 +279,25 @@ namespace jf {
 	}
 	
 	void VertexArray::destroy() {
+		GLState::current().forgetVertexArray(uid);
 		glDeleteVertexArrays(1, &uid);
 		uid = 0;
 	}
 	
 	void VertexArray::bind() {
-		glBindVertexArray(uid);
+		GLState::current().bindVertexArray(uid);
 	}
 	
 	void VertexArray::unbind() {
-		glBindVertexArray(0);
+		GLState::current().bindVertexArray(0);
 	}
 
 	VertexLayout::VertexLayout()
 	:	stride(0)
 	{}
 	
-	void VertexLayout::addAttribute(GLint loc, GLint size, GLenum type) {
-		attributes.push_back({loc,size,type});
+	void VertexLayout::addAttribute(GLint loc, GLint size, GLenum type, GLuint divisor) {
+		attributes.push_back({loc,size,type,divisor});
 	}
 	
 	void VertexLayout::fitStrideToAttributes() {
@@ -87,6 +322,7 @@ namespace jf {
 	}
 	
 	void Buffer::destroy() {
+		GLState::current().forgetBuffer(uid);
 		glDeleteBuffers(1, &uid);
 		uid = 0;
 	}
@@ -97,11 +333,11 @@ namespace jf {
 	}
 	
 	void Buffer::bind() {
-		glBindBuffer(target, uid);
+		GLState::current().bindBuffer(target, uid);
 	}
 	
 	void Buffer::unbind() {
-		glBindBuffer(target, 0);
+		GLState::current().bindBuffer(target, 0);
 	}
 	
 	Buffer::operator bool() {
@@ -116,11 +352,248 @@ namespace jf {
 		glUnmapBuffer(target);
 	}
 	
+	PixelBufferRing::PixelBufferRing()
+	:	current(-1)
+	,	acquired(false)
+	,	persistent(false)
+	,	stats()
+	{}
+	
+	void PixelBufferRing::create(int count) {
+		destroy();
+		
+#ifdef GL_MAP_PERSISTENT_BIT
+		GLint major = 0, minor = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		persistent = major > 4 || (major == 4 && minor >= 4);
+#endif
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		slots.resize(std::max(1, count));
+		for(Slot& slot : slots) {
+			slot.size = 0;
+			slot.fence = 0;
+			slot.mapped = NULL;
+			slot.owned = false;
+			glGenBuffers(1, &slot.uid);
+		}
+		current = -1;
+	}
+	
+	void PixelBufferRing::destroy() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for(Slot& slot : slots) {
+			if(slot.fence)
+				glDeleteSync(slot.fence);
+			if(slot.mapped) {
+				GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.uid);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			GLState::current().forgetBuffer(slot.uid);
+			glDeleteBuffers(1, &slot.uid);
+		}
+		GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		slots.clear();
+		stats = Stats();
+	}
+	
+	void PixelBufferRing::allocate(Slot& slot, GLsizeiptr size) {
+		// whatever was mapped goes with the old storage
+		void* mapped = NULL;
+		if(slot.mapped)
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		
+#ifdef GL_MAP_PERSISTENT_BIT
+		if(persistent) {
+			// immutable storage can't grow, start over with a new buffer
+			GLState::current().forgetBuffer(slot.uid);
+			glDeleteBuffers(1, &slot.uid);
+			glGenBuffers(1, &slot.uid);
+			GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.uid);
+			
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+			mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+		}
+		else
+#endif
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		slot.size = size;
+		slot.mapped = mapped;
+	}
+	
+	bool PixelBufferRing::retire(Slot& slot, bool wait) {
+		if(!slot.fence)
+			return true;
+		
+		// the gpu is normally long done, it's only still reading if the
+		// cpu got a whole ring ahead
+		if(glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+			if(!wait)
+				return false;
+			auto start = std::chrono::steady_clock::now();
+			glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.stalls++;
+			stats.stallTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		return true;
+	}
+	
+	void* PixelBufferRing::mapSlot(Slot& slot, GLsizeiptr size) {
+		GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.uid);
+		if(slot.size < size)
+			allocate(slot, size);
+		if(slot.mapped)
+			return slot.mapped;
+		
+		// fenced already, so orphaning and skipping the driver's sync is safe
+		GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+		void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot.size, access);
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		slot.mapped = mapped;
+		return mapped;
+	}
+	
+	void* PixelBufferRing::map(GLsizeiptr size) {
+		// the next buffer no frame is holding on to
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			int n = (int)slots.size();
+			int next = -1;
+			for(int i=1; i<=n && next < 0; i++)
+				if(!slots[(current + i + n) % n].owned)
+					next = (current + i + n) % n;
+			if(next < 0)
+				return NULL;
+			
+			current = next;
+			slots[current].owned = true;
+			acquired = false;
+			stats.maps++;
+		}
+		
+		Slot& slot = slots[current];
+		retire(slot, true);
+		void* mapped = mapSlot(slot, size);
+		if(!mapped) {
+			std::lock_guard<std::mutex> lock(mutex);
+			slot.owned = false;
+		}
+		return mapped;
+	}
+	
+	void PixelBufferRing::unmap() {
+		if(current < 0 || persistent)
+			return;
+		
+		Slot& slot = slots[current];
+		if(slot.mapped)
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		slot.mapped = NULL;
+	}
+	
+	void PixelBufferRing::fence() {
+		if(current < 0)
+			return;
+		
+		GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		Slot& slot = slots[current];
+		slot.fence = fence;
+		// a frame's buffer stays its until the frame lets go
+		if(!acquired)
+			slot.owned = false;
+	}
+	
+	void PixelBufferRing::prepare(GLsizeiptr size) {
+		for(Slot& slot : slots) {
+			{
+				// ours while it's remapped, so acquire() can't hand out
+				// memory that's about to be unmapped
+				std::lock_guard<std::mutex> lock(mutex);
+				if(slot.owned)
+					continue;
+				slot.owned = true;
+			}
+			
+			if(retire(slot, false) && (!slot.mapped || slot.size < size))
+				mapSlot(slot, size);
+			
+			std::lock_guard<std::mutex> lock(mutex);
+			slot.owned = false;
+		}
+		GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	
+	int PixelBufferRing::acquire(GLsizeiptr size, uint8_t** bytes) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for(int i=0; i<slots.size(); i++) {
+			Slot& slot = slots[i];
+			if(slot.owned || slot.fence || !slot.mapped || slot.size < size)
+				continue;
+			
+			slot.owned = true;
+			*bytes = (uint8_t*)slot.mapped;
+			return i;
+		}
+		
+		stats.misses++;
+		return -1;
+	}
+	
+	void PixelBufferRing::release(int index) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if(index >= 0 && index < slots.size())
+			slots[index].owned = false;
+	}
+	
+	void PixelBufferRing::bindAcquired(int index) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current = index;
+			acquired = true;
+			stats.maps++;
+			stats.direct++;
+		}
+		
+		GLState::current().bindBuffer(GL_PIXEL_UNPACK_BUFFER, slots[index].uid);
+		unmap();
+	}
+	
+	bool PixelBufferRing::isPersistent() const {
+		return persistent;
+	}
+	
+	PixelBufferRing::Stats PixelBufferRing::getStats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+	
+	PixelBufferRing::operator bool() const {
+		return !slots.empty();
+	}
+	
 	void Buffer::configure(const VertexLayout& layout) {
 		int offset = 0;
 		for(const VertexLayout::Attribute& attrib : layout.attributes) {
 			glEnableVertexAttribArray(attrib.location);
 			glVertexAttribPointer(attrib.location, attrib.size, attrib.type, GL_FALSE, layout.stride, BUFFER_OFFSET(offset));
+			if(attrib.divisor)
+				glVertexAttribDivisor(attrib.location, attrib.divisor);
 			offset += attrib.size * glTypeSizeLookup.at(attrib.type);
 		}
 	}
@@ -135,6 +608,7 @@ namespace jf {
 	}
 	
 	void Program::destroy() {
+		GLState::current().forgetProgram(uid);
 		glDeleteProgram(uid);
 		uid = 0;
 	}
@@ -197,11 +671,11 @@ namespace jf {
 	}
 	
 	void Program::bind() {
-		glUseProgram(uid);
+		GLState::current().useProgram(uid);
 	}
 	
 	void Program::unbind() {
-		glUseProgram(0);
+		GLState::current().useProgram(0);
 	}
 	
 	GLint Program::getUniformLocation(const std::string& name) {
@@ -224,7 +698,8 @@ namespace jf {
 	}
 	
 	void Program::setUniform(GLint loc, int val) {
-		glUniform1f(loc, val);
+		// samplers only take integers
+		glUniform1i(loc, val);
 	}
 
 	void Program::setUniform(GLint loc, float val) {
@@ -247,6 +722,10 @@ namespace jf {
 		glUniform4fv(loc, 1, &val.x);
 	}
 	
+	void Program::setUniform(GLint loc, glm::mat3 val) {
+		glUniformMatrix3fv(loc, 1, GL_FALSE, &val[0][0]);
+	}
+	
 	void Program::setUniform(GLint loc, glm::mat4 val) {
 		glUniformMatrix4fv(loc, 1, GL_FALSE, &val[0][0]);
 	}
@@ -285,6 +764,8 @@ namespace jf {
 	,	target(0)
 	,	width(0)
 	,	height(0)
+	,	layers(0)
+	,	allocatedFormat(0)
 	{}
 	
 	void Texture::create(GLenum target, GLenum format) {
@@ -295,15 +776,37 @@ namespace jf {
 	}
 	
 	void Texture::destroy() {
+		GLState::current().forgetTexture(uid);
 		glDeleteTextures(1, &uid);
+		allocatedFormat = 0;
 	}
 	
 	void Texture::upload(GLsizei width, GLsizei height, GLenum uploadFormat, const GLubyte* pixels, int mipMapLevel) {
 		this->width = width;
 		this->height = height;
+		if(mipMapLevel == 0)
+			allocatedFormat = format;
 		glTexImage2D(target, mipMapLevel, format, width, height, 0, uploadFormat, GL_UNSIGNED_BYTE, pixels);
 	}
 	
+	void Texture::update(GLsizei width, GLsizei height, GLenum uploadFormat, const GLubyte* pixels) {
+		if(width != this->width || height != this->height || format != allocatedFormat)
+			upload(width, height, uploadFormat, NULL);
+		glTexSubImage2D(target, 0, 0, 0, width, height, uploadFormat, GL_UNSIGNED_BYTE, pixels);
+	}
+	
+	void Texture::allocateLayers(GLsizei width, GLsizei height, GLsizei layers, GLenum uploadFormat) {
+		this->width = width;
+		this->height = height;
+		this->layers = layers;
+		allocatedFormat = format;
+		glTexImage3D(target, 0, format, width, height, layers, 0, uploadFormat, GL_UNSIGNED_BYTE, NULL);
+	}
+	
+	void Texture::updateLayer(GLint layer, GLenum uploadFormat, const GLubyte* pixels) {
+		glTexSubImage3D(target, 0, 0, 0, layer, width, height, 1, uploadFormat, GL_UNSIGNED_BYTE, pixels);
+	}
+	
 	void Texture::generateMipMaps() {
 		glGenerateMipmap(target);
 	}
@@ -323,19 +826,19 @@ namespace jf {
 	}
 	
 	void Texture::bind() {
-		glBindTexture(target, uid);
+		GLState::current().bindTexture(target, uid);
 	}
 	
 	void Texture::unbind() {
-		glBindTexture(target, 0);
+		GLState::current().bindTexture(target, 0);
 	}
 	
 	void Texture::unbind(GLenum target) {
-		glBindTexture(target, 0);
+		GLState::current().bindTexture(target, 0);
 	}
 
 	void Texture::setActiveUnit(int unit) {
-		glActiveTexture(GL_TEXTURE0 + unit);
+		GLState::current().setActiveUnit(unit);
 	}
 
 }
\ No newline at end of file
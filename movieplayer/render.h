@@ -11,12 +11,110 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <mutex>
 
 #include <OpenGL/gl3.h>
 
 #include <glm/glm.hpp>
 
 namespace jf {
+	
+	class Buffer;
+	class Texture;
+	class VertexArray;
+	class Program;
+	
+	// what's bound on a context, so the wrappers below can skip binds that
+	// wouldn't change anything. it's only right as long as every bind goes
+	// through them, invalidate() after anything that doesn't. GL thread only
+	class GLState {
+	public:
+		enum Call {
+			BindBuffer,
+			BindTexture,
+			ActiveTexture,
+			BindVertexArray,
+			UseProgram,
+			CallCount
+		};
+		
+		// calls made to the driver and ones skipped, per kind
+		struct Profile {
+			int64_t frames;
+			int64_t issued[CallCount];
+			int64_t skipped[CallCount];
+		};
+		
+		GLState();
+		// the state of whichever context is current, there's a default one
+		// for apps that only ever have the one
+		static GLState& current();
+		void makeCurrent();
+		
+		void bindBuffer(GLenum target, GLuint uid);
+		// on the active unit
+		void bindTexture(GLenum target, GLuint uid);
+		void setActiveUnit(int unit);
+		void bindVertexArray(GLuint uid);
+		void useProgram(GLuint uid);
+		
+		GLuint getBuffer(GLenum target) const;
+		GLuint getTexture(GLenum target) const;
+		int getActiveUnit() const;
+		GLuint getVertexArray() const;
+		GLuint getProgram() const;
+		
+		// deleting an object unbinds it
+		void forgetBuffer(GLuint uid);
+		void forgetTexture(GLuint uid);
+		void forgetVertexArray(GLuint uid);
+		void forgetProgram(GLuint uid);
+		// everything is rebound next time it's asked for
+		void invalidate();
+		
+		// a frame's worth of calls has gone by, for per frame averages
+		void endFrame();
+		Profile getProfile() const;
+		void resetProfile();
+		static const char* getCallName(Call call);
+		
+		// bindings not yet seen, the first bind always goes through
+		static const GLuint Unknown = ~0u;
+		
+	private:
+		GLState(const GLState&) =delete;
+		GLState& operator=(const GLState&) =delete;
+		
+		bool change(Call call, GLuint& bound, GLuint uid);
+		
+		std::map<GLenum,GLuint> buffers;
+		// keyed by unit then target
+		std::map<std::pair<int,GLenum>,GLuint> textures;
+		int activeUnit;
+		GLuint vertexArray;
+		GLuint program;
+		Profile profile;
+	};
+	
+	// binds for the length of a scope, then puts back what was bound before.
+	// asks GL what that was when the cache hasn't seen a bind for it yet
+	class ScopedBind {
+	public:
+		explicit ScopedBind(Buffer& buffer);
+		explicit ScopedBind(Texture& texture);
+		explicit ScopedBind(VertexArray& vertexArray);
+		explicit ScopedBind(Program& program);
+		~ScopedBind();
+		
+	private:
+		ScopedBind(const ScopedBind&) =delete;
+		ScopedBind& operator=(const ScopedBind&) =delete;
+		
+		GLState::Call call;
+		GLenum target;
+		int unit;
+		GLuint previous;
+	};
 
 	class VertexArray {
 	public:
@@ -35,12 +133,15 @@ namespace jf {
 			GLint location;
 			GLint size;
 			GLenum type;
+			GLuint divisor;
 		};
 		GLsizei stride;
 		std::vector<Attribute> attributes;
 		
 		VertexLayout();
-		void addAttribute(GLint loc, GLint size, GLenum type);
+		// a divisor moves the attribute on once per that many instances
+		// rather than once per vertex
+		void addAttribute(GLint loc, GLint size, GLenum type, GLuint divisor=0);
 		void fitStrideToAttributes();
 	};
 	
@@ -66,6 +167,76 @@ namespace jf {
 		
 		explicit operator bool();
 	};
+	
+	// pixel unpack buffers used in turn, so the cpu fills one while the gpu
+	// still reads the ones before it. a fence after each upload keeps a buffer
+	// from being written again before the gpu is done with it. buffers stay
+	// mapped where GL has persistent mapping (4.4), otherwise each map
+	// orphans the old storage.
+	// other threads can write into buffers mapped ahead of time with
+	// acquire(), everything else has to be called on the GL thread
+	class PixelBufferRing {
+	public:
+		struct Stats {
+			int64_t maps;
+			// maps that had to wait for the gpu, and how long all told
+			int64_t stalls;
+			double stallTime;
+			// uploads written straight into a buffer by acquire()'s caller,
+			// and acquire() calls that found nothing free
+			int64_t direct, misses;
+		};
+		
+		PixelBufferRing();
+		void create(int count);
+		void destroy();
+		
+		// binds the next buffer no one has acquired to GL_PIXEL_UNPACK_BUFFER
+		// and returns size bytes to write, NULL if there isn't one or it couldn't
+		// be mapped. glTex*Image calls read it at offsets until fence()
+		void* map(GLsizeiptr size);
+		void unmap();
+		// after the calls reading the buffer, unbinds it
+		void fence();
+		
+		// maps every buffer that's free and the gpu is done with, at least
+		// size bytes, so acquire() has something to hand out
+		void prepare(GLsizeiptr size);
+		// any thread. a mapped buffer of at least size bytes that's the
+		// caller's until release(), -1 if none is ready
+		int acquire(GLsizeiptr size, uint8_t** bytes);
+		void release(int index);
+		// instead of map() and unmap(), for a buffer acquire() handed out and
+		// the caller filled. it's still theirs after fence()
+		void bindAcquired(int index);
+		
+		bool isPersistent() const;
+		Stats getStats();
+		explicit operator bool() const;
+		
+	private:
+		struct Slot {
+			GLuint uid;
+			GLsizeiptr size;
+			GLsync fence;
+			void* mapped;
+			bool owned;
+		};
+		
+		void allocate(Slot& slot, GLsizeiptr size);
+		void* mapSlot(Slot& slot, GLsizeiptr size);
+		// false if the gpu is still reading and wait is false
+		bool retire(Slot& slot, bool wait);
+		
+		// guards the slots' state against acquire() and release()
+		std::mutex mutex;
+		std::vector<Slot> slots;
+		int current;
+		// the current buffer came from acquire()
+		bool acquired;
+		bool persistent;
+		Stats stats;
+	};
 
 	class Program {
 	public:
@@ -98,6 +269,7 @@ namespace jf {
 		void setUniform(GLint loc, glm::vec2 val);
 		void setUniform(GLint loc, glm::vec3 val);
 		void setUniform(GLint loc, glm::vec4 val);
+		void setUniform(GLint loc, glm::mat3 val);
 		void setUniform(GLint loc, glm::mat4 val);
 	};
 	
@@ -119,11 +291,18 @@ namespace jf {
 		GLenum target;
 		GLenum format;
 		GLsizei width, height;
+		// GL_TEXTURE_2D_ARRAY only
+		GLsizei layers;
 		
 		Texture();
 		void create(GLenum target, GLenum format);
 		void destroy();
 		void upload(GLsizei width, GLsizei height, GLenum uploadFormat, const GLubyte* pixels, int mipMapLevel=0);
+		// replaces level 0 in place, only allocating when the size or format changes
+		void update(GLsizei width, GLsizei height, GLenum uploadFormat, const GLubyte* pixels);
+		// for GL_TEXTURE_2D_ARRAY, level 0 of every layer left undefined
+		void allocateLayers(GLsizei width, GLsizei height, GLsizei layers, GLenum uploadFormat);
+		void updateLayer(GLint layer, GLenum uploadFormat, const GLubyte* pixels);
 		void generateMipMaps();
 		void configure(TextureParameters params);
 		
@@ -134,6 +313,10 @@ namespace jf {
 		static void unbind(GLenum target);
 		
 		static void setActiveUnit(int unit);
+		
+	private:
+		// what level 0 was last allocated as, 0 if it hasn't been
+		GLenum allocatedFormat;
 	};
 	
 }
\ No newline at end of file
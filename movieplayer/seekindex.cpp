@@ -0,0 +1,265 @@
+//
+//  seekindex.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "seekindex.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace jf {
+	
+	static const int64_t NoPts = INT64_MIN;
+	
+	static bool entryBefore(const KeyframeIndex::Entry& e, int64_t pts) {
+		return e.pts < pts;
+	}
+	
+	KeyframeIndex::KeyframeIndex()
+	:	lastPts(NoPts)
+	,	complete(false)
+	{}
+	
+	void KeyframeIndex::add(const Entry& e) {
+		std::lock_guard<std::mutex> lock(mutex);
+		
+		// playback mostly appends, so check the end first
+		size_t i = entries.size();
+		if(!entries.empty() && entries.back().pts >= e.pts)
+			i = std::lower_bound(entries.begin(), entries.end(), e.pts, entryBefore) - entries.begin();
+		
+		if(i < entries.size() && entries[i].pts == e.pts) {
+			// seen it before, but maybe not from the start of the stream
+			if(entries[i].frame < 0)
+				entries[i].frame = e.frame;
+		}
+		else {
+			entries.insert(entries.begin() + i, e);
+			followed.insert(followed.begin() + i, false);
+		}
+		
+		// nothing was skipped between the last keyframe and this one
+		if(i > 0 && lastPts != NoPts && entries[i-1].pts == lastPts)
+			followed[i-1] = true;
+		lastPts = e.pts;
+	}
+	
+	void KeyframeIndex::restart() {
+		std::lock_guard<std::mutex> lock(mutex);
+		lastPts = NoPts;
+	}
+	
+	bool KeyframeIndex::find(int64_t pts, Entry* e) {
+		std::lock_guard<std::mutex> lock(mutex);
+		
+		// first entry after pts, the one before it is what we want
+		size_t i = std::upper_bound(entries.begin(), entries.end(), pts, [](int64_t p, const Entry& x) { return p < x.pts; }) - entries.begin();
+		if(i == 0)
+			return false;
+		
+		if(!complete && !followed[i-1])
+			return false;
+		
+		*e = entries[i-1];
+		return true;
+	}
+	
+	void KeyframeIndex::load(const Entry* e, int count) {
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.assign(e, e + count);
+		followed.assign(count, true);
+		lastPts = NoPts;
+		complete = true;
+	}
+	
+	std::vector<KeyframeIndex::Entry> KeyframeIndex::getEntries() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries;
+	}
+	
+	void KeyframeIndex::setComplete() {
+		std::lock_guard<std::mutex> lock(mutex);
+		complete = true;
+	}
+	
+	bool KeyframeIndex::isComplete() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return complete;
+	}
+	
+	int KeyframeIndex::getCount() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return (int)entries.size();
+	}
+	
+	static const char Magic[8] = { 'J', 'F', 'S', 'E', 'E', 'K', 'I', 'X' };
+	static const uint32_t ByteOrder = 0x01020304;
+	// bytes hashed from each end of the movie
+	static const size_t HashSpan = 64 * 1024;
+	
+	SeekIndexFile::SeekIndexFile()
+	:	base(NULL)
+	,	length(0)
+	,	header(NULL)
+	,	streams(NULL)
+	{}
+	
+	SeekIndexFile::~SeekIndexFile() {
+		if(base)
+			munmap(base, length);
+	}
+	
+	std::string SeekIndexFile::getPath(const char* moviePath) {
+		return std::string(moviePath) + ".seekindex";
+	}
+	
+	bool SeekIndexFile::identify(const char* moviePath, Header* h) {
+		struct stat st;
+		if(stat(moviePath, &st) != 0)
+			return false;
+		
+		FILE* fp = fopen(moviePath, "rb");
+		if(!fp)
+			return false;
+		
+		// fnv-1a over the first and last chunk, catches files rewritten in place
+		std::vector<uint8_t> buf(HashSpan);
+		uint64_t hash = 14695981039346656037ULL;
+		for(int end=0; end<2; end++) {
+			if(end == 1 && st.st_size > HashSpan)
+				fseeko(fp, st.st_size - HashSpan, SEEK_SET);
+			size_t n = fread(buf.data(), 1, buf.size(), fp);
+			for(size_t i=0; i<n; i++)
+				hash = (hash ^ buf[i]) * 1099511628211ULL;
+		}
+		fclose(fp);
+		
+		h->fileSize = st.st_size;
+		h->modifiedTime = st.st_mtime;
+		h->hash = hash;
+		return true;
+	}
+	
+	SeekIndexFile* SeekIndexFile::open(const char* moviePath) {
+		Header movie;
+		if(!identify(moviePath, &movie))
+			return NULL;
+		
+		int fd = ::open(getPath(moviePath).c_str(), O_RDONLY);
+		if(fd < 0)
+			return NULL;
+		
+		struct stat st;
+		void* base = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && st.st_size >= sizeof(Header))
+			base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if(base == MAP_FAILED)
+			return NULL;
+		
+		SeekIndexFile* file = new SeekIndexFile();
+		file->base = base;
+		file->length = st.st_size;
+		file->header = (const Header*)base;
+		file->streams = (const Stream*)((const uint8_t*)base + sizeof(Header));
+		
+		const Header* h = file->header;
+		bool valid = memcmp(h->magic, Magic, sizeof(Magic)) == 0
+			&& h->version == Version && h->byteOrder == ByteOrder
+			&& h->headerSize == sizeof(Header) && h->streamSize == sizeof(Stream) && h->entrySize == sizeof(KeyframeIndex::Entry)
+			&& h->fileSize == movie.fileSize && h->modifiedTime == movie.modifiedTime && h->hash == movie.hash
+			&& sizeof(Header) + (uint64_t)h->streamCount * sizeof(Stream) <= file->length;
+		
+		// every stream's keyframes have to be inside the file
+		for(int i=0; valid && i<h->streamCount; i++) {
+			const Stream& s = file->streams[i];
+			valid = s.entryOffset <= file->length && s.entryCount <= (file->length - s.entryOffset) / sizeof(KeyframeIndex::Entry);
+		}
+		
+		if(!valid) {
+			delete file;
+			return NULL;
+		}
+		return file;
+	}
+	
+	bool SeekIndexFile::write(const char* moviePath, int64_t startTime, int64_t duration,
+							  const std::vector<Stream>& streams, const std::vector<std::vector<KeyframeIndex::Entry>>& keyframes)
+	{
+		Header h;
+		memset(&h, 0, sizeof(h));
+		if(!identify(moviePath, &h))
+			return false;
+		
+		memcpy(h.magic, Magic, sizeof(Magic));
+		h.version = Version;
+		h.byteOrder = ByteOrder;
+		h.headerSize = sizeof(Header);
+		h.streamSize = sizeof(Stream);
+		h.entrySize = sizeof(KeyframeIndex::Entry);
+		h.streamCount = (uint32_t)streams.size();
+		h.startTime = startTime;
+		h.duration = duration;
+		
+		// keyframes follow the stream table, one run per stream
+		std::vector<Stream> table(streams);
+		uint64_t offset = sizeof(Header) + table.size() * sizeof(Stream);
+		for(size_t i=0; i<table.size(); i++) {
+			table[i].entryOffset = offset;
+			table[i].entryCount = (i < keyframes.size()) ? keyframes[i].size() : 0;
+			offset += table[i].entryCount * sizeof(KeyframeIndex::Entry);
+		}
+		
+		std::string path = getPath(moviePath);
+		std::string temp = path + ".tmp";
+		FILE* fp = fopen(temp.c_str(), "wb");
+		if(!fp)
+			return false;
+		
+		bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+		if(!table.empty())
+			ok = ok && fwrite(table.data(), sizeof(Stream), table.size(), fp) == table.size();
+		for(size_t i=0; i<table.size(); i++) {
+			if(table[i].entryCount)
+				ok = ok && fwrite(keyframes[i].data(), sizeof(KeyframeIndex::Entry), keyframes[i].size(), fp) == keyframes[i].size();
+		}
+		ok = (fclose(fp) == 0) && ok;
+		
+		if(!ok || rename(temp.c_str(), path.c_str()) != 0) {
+			unlink(temp.c_str());
+			return false;
+		}
+		return true;
+	}
+	
+	const SeekIndexFile::Header* SeekIndexFile::getHeader() const {
+		return header;
+	}
+	
+	int SeekIndexFile::getStreamCount() const {
+		return header->streamCount;
+	}
+	
+	const SeekIndexFile::Stream* SeekIndexFile::getStream(int i) const {
+		if(i < 0 || i >= header->streamCount)
+			return NULL;
+		return &streams[i];
+	}
+	
+	const KeyframeIndex::Entry* SeekIndexFile::getEntries(int i, int* count) const {
+		const Stream* s = getStream(i);
+		*count = s ? (int)s->entryCount : 0;
+		if(!s)
+			return NULL;
+		return (const KeyframeIndex::Entry*)((const uint8_t*)base + s->entryOffset);
+	}
+	
+}
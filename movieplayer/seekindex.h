@@ -0,0 +1,123 @@
+//
+//  seekindex.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace jf {
+	
+	// keyframes of one stream in presentation order, filled in as they're
+	// read. lookups only trust a keyframe if the one after it is known too,
+	// otherwise there could be a closer one nobody has seen yet
+	class KeyframeIndex {
+	public:
+		struct Entry {
+			int64_t pts;	// stream time base
+			int64_t dts;	// what the demuxer seeks by, pts if the container has no dts
+			int64_t pos;	// byte offset, -1 if unknown
+			int64_t frame;	// packets before this one in the stream, -1 if unknown
+		};
+		
+		KeyframeIndex();
+		
+		// keyframes arrive in reading order, each one is assumed to follow
+		// the last unless restart() was called in between
+		void add(const Entry& e);
+		void restart();
+		
+		// nearest keyframe at or before pts, false if that isn't known for sure
+		bool find(int64_t pts, Entry* e);
+		
+		// replaces everything with a complete, sorted set of keyframes
+		void load(const Entry* e, int count);
+		std::vector<Entry> getEntries();
+		
+		// every keyframe in the stream has been added
+		void setComplete();
+		bool isComplete();
+		int getCount();
+		
+	private:
+		KeyframeIndex(const KeyframeIndex&) =delete;
+		KeyframeIndex& operator=(const KeyframeIndex&) =delete;
+		
+		std::mutex mutex;
+		std::vector<Entry> entries;
+		// followed[i] is set once entries[i+1] was read right after entries[i]
+		std::vector<bool> followed;
+		int64_t lastPts;
+		bool complete;
+	};
+	
+	// keyframes and stream details saved next to a movie as <movie>.seekindex,
+	// so reopening it doesn't have to scan or probe. the layout is plain
+	// structs in host byte order, anything that doesn't match is ignored
+	class SeekIndexFile {
+	public:
+		// bump whenever Header, Stream or KeyframeIndex::Entry change
+		static const uint32_t Version = 1;
+		
+		// what avformat_find_stream_info would have worked out
+		struct Stream {
+			int32_t codecType, codecId;
+			int32_t width, height, pixelFormat;
+			int32_t colorSpace, colorRange;
+			int32_t sampleFormat, sampleRate, channels;
+			uint64_t channelLayout;
+			int32_t timeBaseNum, timeBaseDen;
+			int32_t codecTimeBaseNum, codecTimeBaseDen;
+			int32_t frameRateNum, frameRateDen;
+			int64_t startTime, duration, frameCount;
+			// keyframes, only video streams have any
+			uint64_t entryOffset, entryCount;
+		};
+		
+		struct Header {
+			char magic[8];
+			uint32_t version, byteOrder;
+			uint32_t headerSize, streamSize, entrySize;
+			uint32_t streamCount, reserved;
+			// the movie this was made from
+			uint64_t fileSize;
+			int64_t modifiedTime;
+			uint64_t hash;
+			int64_t startTime, duration;
+		};
+		
+		// maps the sidecar for moviePath, NULL if there isn't one or it's stale
+		static SeekIndexFile* open(const char* moviePath);
+		// streams[i] gets keyframes[i], written to a temporary file and renamed over the old one
+		static bool write(const char* moviePath, int64_t startTime, int64_t duration,
+						  const std::vector<Stream>& streams, const std::vector<std::vector<KeyframeIndex::Entry>>& keyframes);
+		static std::string getPath(const char* moviePath);
+		~SeekIndexFile();
+		
+		const Header* getHeader() const;
+		int getStreamCount() const;
+		const Stream* getStream(int i) const;
+		const KeyframeIndex::Entry* getEntries(int i, int* count) const;
+		
+	private:
+		SeekIndexFile();
+		SeekIndexFile(const SeekIndexFile&) =delete;
+		SeekIndexFile& operator=(const SeekIndexFile&) =delete;
+		
+		// size, modification time and a hash of both ends of the movie
+		static bool identify(const char* moviePath, Header* h);
+		
+		void* base;
+		size_t length;
+		const Header* header;
+		const Stream* streams;
+	};
+	
+}
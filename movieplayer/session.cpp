@@ -0,0 +1,58 @@
+//
+//  session.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "session.h"
+
+namespace jf {
+	
+	MediaSession::MediaSession()
+	:	demuxer(NULL)
+	,	videoDecoder(NULL)
+	,	audioDecoder(NULL)
+	{}
+	
+	MediaSession::~MediaSession() {
+		delete videoDecoder;
+		delete audioDecoder;
+		delete demuxer;
+	}
+	
+	MediaSession* MediaSession::open(const char* path, int demuxFlags, const StreamSelection& selection) {
+		// nothing's read until both queues are there to take it
+		Demuxer* demuxer = Demuxer::open(path, demuxFlags | Demuxer::Deferred, selection);
+		if(!demuxer)
+			return NULL;
+		
+		MediaSession* session = new MediaSession();
+		session->demuxer = demuxer;
+		session->videoDecoder = VideoDecoder::open(demuxer);
+		session->audioDecoder = AudioDecoder::open(demuxer);
+		if(!session->videoDecoder && !session->audioDecoder) {
+			delete session;
+			return NULL;
+		}
+		
+		demuxer->start();
+		return session;
+	}
+	
+	Demuxer* MediaSession::getDemuxer() { return demuxer; }
+	VideoDecoder* MediaSession::getVideoDecoder() { return videoDecoder; }
+	AudioDecoder* MediaSession::getAudioDecoder() { return audioDecoder; }
+	
+	void MediaSession::seekToTime(double time) {
+		if(videoDecoder) {
+			if(audioDecoder)
+				audioDecoder->followSeek(time);
+			videoDecoder->seekToTime(time);
+		}
+		else if(audioDecoder) {
+			audioDecoder->seekToTime(time);
+		}
+	}
+	
+}
@@ -0,0 +1,44 @@
+//
+//  session.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include "decoder.h"
+
+namespace jf {
+	
+	// one file read once for both its picture and its sound. owns a Demuxer
+	// and the decoders fed from it, a MoviePlayer and an AudioPlayer can both
+	// be opened on it. close them before deleting the session
+	class MediaSession {
+	public:
+		// NULL unless there's at least one of audio or video. selection picks
+		// the tracks, e.g. the audio in another language
+		static MediaSession* open(const char* path, int demuxFlags=Demuxer::UseSeekIndex, const StreamSelection& selection=StreamSelection());
+		~MediaSession();
+		
+		Demuxer* getDemuxer();
+		// either can be NULL if the file doesn't have that kind of stream
+		VideoDecoder* getVideoDecoder();
+		AudioDecoder* getAudioDecoder();
+		
+		// moves both. the video seeks the demuxer, which it has to do anyway
+		// to land exactly, and the audio picks up after the flush it causes.
+		// the audio update thread finds out through AudioDecoder::hasJumped
+		void seekToTime(double time);
+		
+	private:
+		MediaSession();
+		MediaSession(const MediaSession&) =delete;
+		MediaSession& operator=(const MediaSession&) =delete;
+		
+		Demuxer* demuxer;
+		VideoDecoder* videoDecoder;
+		AudioDecoder* audioDecoder;
+	};
+	
+}
@@ -0,0 +1,233 @@
+//
+//  timestretch.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "timestretch.h"
+
+extern "C" {
+	#include <libavutil/cpu.h>
+}
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define JF_X86 1
+	#include <immintrin.h>
+#endif
+
+namespace jf {
+	
+	// ~12ms hops in 24ms windows, each nudged up to 8ms either way
+	static const int HopMs = 12;
+	static const int SearchMs = 8;
+	
+	static float dotScalar(const float* a, const float* b, int n) {
+		float sum = 0.f;
+		for(int i=0; i<n; i++)
+			sum += a[i] * b[i];
+		return sum;
+	}
+
+#if JF_X86
+	// two accumulators so the adds don't wait on each other
+	__attribute__((target("sse")))
+	static float dotSSE(const float* a, const float* b, int n) {
+		__m128 sum0 = _mm_setzero_ps();
+		__m128 sum1 = _mm_setzero_ps();
+		int i = 0;
+		for(; i+8<=n; i+=8) {
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+		}
+		
+		float lanes[4];
+		_mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+		float sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for(; i<n; i++)
+			sum += a[i] * b[i];
+		return sum;
+	}
+	
+	__attribute__((target("avx")))
+	static float dotAVX(const float* a, const float* b, int n) {
+		__m256 sum0 = _mm256_setzero_ps();
+		__m256 sum1 = _mm256_setzero_ps();
+		int i = 0;
+		for(; i+16<=n; i+=16) {
+			sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+			sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+		}
+		
+		float lanes[8];
+		_mm256_storeu_ps(lanes, _mm256_add_ps(sum0, sum1));
+		float sum = 0.f;
+		for(int l=0; l<8; l++)
+			sum += lanes[l];
+		for(; i<n; i++)
+			sum += a[i] * b[i];
+		return sum;
+	}
+#endif
+	
+	TimeStretcher::TimeStretcher()
+	:	channels(0)
+	,	hop(0)
+	,	search(0)
+	,	tempo(1.f)
+	,	nominal(0.0)
+	,	previous(-1)
+	,	outputRead(0)
+	,	dot(dotScalar)
+	{}
+	
+	TimeStretcher::~TimeStretcher() {}
+	
+	TimeStretcher* TimeStretcher::create(int channels, int sampleRate) {
+		if(channels <= 0 || sampleRate <= 0)
+			return NULL;
+		
+		TimeStretcher* ts = new TimeStretcher();
+		ts->channels = channels;
+		ts->hop = std::max(16, sampleRate * HopMs / 1000);
+		ts->search = sampleRate * SearchMs / 1000;
+		
+		// periodic hann, overlapped by half it sums to exactly one
+		ts->window.resize(ts->hop * 2);
+		for(int i=0; i<ts->hop*2; i++)
+			ts->window[i] = 0.5f - 0.5f * cosf(M_PI * i / ts->hop);
+		ts->overlap.assign(ts->hop * channels, 0.f);
+		ts->target.resize(ts->hop);
+		ts->candidates.resize(ts->search * 2 + ts->hop * 2);
+		
+#if JF_X86
+		int flags = av_get_cpu_flags();
+		if(flags & AV_CPU_FLAG_SSE)
+			ts->dot = dotSSE;
+		if(flags & AV_CPU_FLAG_AVX)
+			ts->dot = dotAVX;
+#endif
+		return ts;
+	}
+	
+	void TimeStretcher::setTempo(float t) { tempo = std::max(0.25f, std::min(16.f, t)); }
+	float TimeStretcher::getTempo() const { return tempo; }
+	
+	void TimeStretcher::push(const int16_t* samples, int frames) {
+		size_t start = input.size();
+		input.resize(start + frames * channels);
+		for(int i=0; i<frames*channels; i++)
+			input[start + i] = samples[i];
+		
+		while(step())
+			;
+	}
+	
+	int TimeStretcher::pull(int16_t* samples, int frames) {
+		int n = std::min(frames, getAvailable());
+		std::copy(output.begin() + outputRead * channels, output.begin() + (outputRead + n) * channels, samples);
+		outputRead += n;
+		
+		// shuffle down once the read part is the bigger part
+		if(outputRead * channels * 2 > (int)output.size()) {
+			output.erase(output.begin(), output.begin() + outputRead * channels);
+			outputRead = 0;
+		}
+		return n;
+	}
+	
+	int TimeStretcher::getAvailable() const { return (int)output.size() / channels - outputRead; }
+	
+	void TimeStretcher::reset() {
+		input.clear();
+		output.clear();
+		outputRead = 0;
+		nominal = 0.0;
+		previous = -1;
+		std::fill(overlap.begin(), overlap.end(), 0.f);
+	}
+	
+	bool TimeStretcher::step() {
+		int frames = (int)input.size() / channels;
+		int pos = (int)(nominal + 0.5);
+		if(pos + search + hop * 2 > frames)
+			return false;
+		
+		if(previous >= 0)
+			pos = match(pos);
+		
+		// the first half finishes off the last window
+		size_t start = output.size();
+		output.resize(start + hop * channels);
+		const float* in = &input[pos * channels];
+		for(int i=0; i<hop; i++) {
+			for(int c=0; c<channels; c++) {
+				float s = overlap[i * channels + c] + window[i] * in[i * channels + c];
+				output[start + i * channels + c] = (int16_t)std::max(-32768.f, std::min(32767.f, s));
+			}
+		}
+		
+		in += hop * channels;
+		for(int i=0; i<hop; i++) {
+			for(int c=0; c<channels; c++)
+				overlap[i * channels + c] = window[hop + i] * in[i * channels + c];
+		}
+		
+		previous = pos;
+		nominal += hop * tempo;
+		
+		// drop input that nothing will look at again
+		int drop = std::min(previous + hop, (int)nominal - search);
+		if(drop > hop * 4) {
+			input.erase(input.begin(), input.begin() + drop * channels);
+			nominal -= drop;
+			previous -= drop;
+		}
+		return true;
+	}
+	
+	int TimeStretcher::match(int pos) {
+		int lo = std::max(0, pos - search);
+		int hi = pos + search;
+		int span = hi - lo + hop;
+		
+		// mixed down to mono, the audio that would have followed the last window
+		const float* follow = &input[(previous + hop) * channels];
+		for(int i=0; i<hop; i++) {
+			float s = 0.f;
+			for(int c=0; c<channels; c++)
+				s += follow[i * channels + c];
+			target[i] = s;
+		}
+		
+		const float* from = &input[lo * channels];
+		for(int i=0; i<span; i++) {
+			float s = 0.f;
+			for(int c=0; c<channels; c++)
+				s += from[i * channels + c];
+			candidates[i] = s;
+		}
+		
+		// normalised cross-correlation, energy slides along with the candidate
+		double energy = dot(&candidates[0], &candidates[0], hop);
+		int best = pos;
+		double bestScore = -1.0;
+		for(int p=lo; p<=hi; p++) {
+			const float* c = &candidates[p - lo];
+			double score = dot(c, &target[0], hop) / sqrt(std::max(energy, 0.0) + 1.0);
+			if(score > bestScore) {
+				bestScore = score;
+				best = p;
+			}
+			// c[hop] is one past the candidates on the last position
+			if(p < hi)
+				energy += (double)c[hop] * c[hop] - (double)c[0] * c[0];
+		}
+		
+		return best;
+	}
+	
+}
@@ -0,0 +1,64 @@
+//
+//  timestretch.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace jf {
+	
+	// changes the tempo of interleaved S16 audio without changing its pitch.
+	// WSOLA: windows go out at a fixed hop and come in at hop * tempo, each
+	// one nudged within a small search range to where it lines up best with
+	// the audio that naturally follows the last one
+	class TimeStretcher {
+	public:
+		static TimeStretcher* create(int channels, int sampleRate);
+		~TimeStretcher();
+		
+		// seconds of input per second of output, clamped to 0.25 - 16
+		void setTempo(float tempo);
+		float getTempo() const;
+		
+		void push(const int16_t* samples, int frames);
+		// up to frames out, returns how many there were
+		int pull(int16_t* samples, int frames);
+		int getAvailable() const;
+		// drops everything pushed so far, for seeking
+		void reset();
+		
+	private:
+		TimeStretcher();
+		TimeStretcher(const TimeStretcher&) =delete;
+		TimeStretcher& operator=(const TimeStretcher&) =delete;
+		
+		// windows one more hop of output if there's enough input
+		bool step();
+		// best input position within search of nominal
+		int match(int nominal);
+		
+		int channels;
+		int hop, search;
+		float tempo;
+		
+		// interleaved input as floats, positions count frames from its start
+		std::vector<float> input;
+		double nominal;
+		int previous;
+		
+		std::vector<float> window, overlap;
+		// mono scratch for the search
+		std::vector<float> target, candidates;
+		
+		std::vector<int16_t> output;
+		int outputRead;
+		
+		float (*dot)(const float* a, const float* b, int n);
+	};
+	
+}
@@ -0,0 +1,261 @@
+//
+//  wall.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "wall.h"
+#include "decoder.h"
+#include "convert.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace jf {
+	
+	#define BUFFER_OFFSET(i) (char*)NULL + i
+	
+	// rect then layer
+	static const int InstanceFloats = 5;
+	
+	VideoWall::VideoWall()
+	:	program(NULL)
+	,	width(0)
+	,	height(0)
+	,	maxTiles(0)
+	,	planeCount(0)
+	,	interleavedChroma(false)
+	,	stats()
+	{}
+	
+	VideoWall* VideoWall::create(Program* program, int width, int height, int maxTiles) {
+		GLint maxLayers = 0;
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+		if(!program || width <= 0 || height <= 0 || maxTiles <= 0 || maxTiles > maxLayers)
+			return NULL;
+		
+		VideoWall* wall = new VideoWall();
+		wall->program = program;
+		wall->width = width;
+		wall->height = height;
+		wall->maxTiles = maxTiles;
+		wall->instanceData.reserve(maxTiles * InstanceFloats);
+		
+		// the planes get their layout from the first frame
+		for(Texture& tex : wall->planes) {
+			tex.create(GL_TEXTURE_2D_ARRAY, GL_R8);
+			tex.configure(TextureParameters().setFilters(GL_LINEAR, GL_LINEAR).setLevels(0, 0));
+		}
+		Texture::unbind(GL_TEXTURE_2D_ARRAY);
+		wall->uploadRing.create(3);
+		
+		float corners[] = {
+			0,0,
+			1,0,
+			1,1,
+			0,1
+		};
+		
+		wall->vao.create();
+		wall->quad.create(GL_ARRAY_BUFFER, GL_STATIC_DRAW);
+		wall->quad.upload(sizeof(corners), corners);
+		VertexLayout perVertex;
+		perVertex.addAttribute(0, 2, GL_FLOAT);
+		perVertex.fitStrideToAttributes();
+		wall->quad.configure(perVertex);
+		
+		wall->instances.create(GL_ARRAY_BUFFER, GL_STREAM_DRAW);
+		wall->instances.upload(maxTiles * InstanceFloats * sizeof(float), NULL);
+		VertexLayout perTile;
+		perTile.addAttribute(1, 4, GL_FLOAT, 1);
+		perTile.addAttribute(2, 1, GL_FLOAT, 1);
+		perTile.fitStrideToAttributes();
+		wall->instances.configure(perTile);
+		wall->vao.unbind();
+		wall->instances.unbind();
+		
+		return wall;
+	}
+	
+	VideoWall::~VideoWall() {
+		if(stats.frames > 0) {
+			printf("video wall:\n\t%d tiles\n\t%lld frames\n\t%lld uploads, %lld skipped\n\t%f draw calls/frame\n\t%f ms/frame uploading\n\t%f ms/frame drawing\n",
+				   (int)tiles.size(), stats.frames, stats.uploads, stats.rejected, stats.drawCalls / (double)stats.frames,
+				   stats.uploadTime * 1000.0 / stats.frames, stats.drawTime * 1000.0 / stats.frames);
+		}
+		
+		for(Texture& tex : planes)
+			tex.destroy();
+		uploadRing.destroy();
+		vao.destroy();
+		quad.destroy();
+		instances.destroy();
+	}
+	
+	int VideoWall::add(VideoDecoder* decoder) {
+		if(!decoder || (int)tiles.size() >= maxTiles)
+			return -1;
+		
+		tiles.push_back({decoder, glm::vec4(0.f), false, false});
+		return (int)tiles.size() - 1;
+	}
+	
+	void VideoWall::setRect(int tile, float x, float y, float w, float h) {
+		if(tile < 0 || tile >= (int)tiles.size())
+			return;
+		
+		float vR = height / (float)width;
+		float hNew = w * vR;
+		float wNew = w;
+		
+		if(hNew > h) {
+			float scale = h / hNew;
+			wNew *= scale;
+			hNew *= scale;
+		}
+		
+		x += (w - wNew) / 2.f;
+		y += (h - hNew) / 2.f;
+		
+		tiles[tile].rect = glm::vec4(x, y, wNew, hNew);
+		tiles[tile].visible = true;
+	}
+	
+	void VideoWall::setVisible(int tile, bool visible) {
+		if(tile >= 0 && tile < (int)tiles.size())
+			tiles[tile].visible = visible;
+	}
+	
+	int VideoWall::getTileCount() const { return (int)tiles.size(); }
+	VideoWall::Stats VideoWall::getStats() const { return stats; }
+	
+	bool VideoWall::upload(const std::vector<std::pair<int, VideoFrame::Ptr>>& frames) {
+		// the first frame lays out the arrays, any other shape can't share them
+		std::vector<std::pair<int, VideoFrame::Ptr>> fits;
+		for(auto& tf : frames) {
+			const VideoFrame::Ptr& f = tf.second;
+			bool yuv = f->format == PIX_FMT_YUV420P || f->format == PIX_FMT_NV12;
+			if(yuv && f->width == width && f->height == height && (planeCount == 0 || f->numPlanes == planeCount))
+				fits.push_back(tf);
+			else
+				stats.rejected++;
+		}
+		if(fits.empty())
+			return false;
+		
+		int total = 0;
+		for(auto& tf : fits)
+			total += tf.second->numBytes;
+		
+		uint8_t* mapped = (uint8_t*)uploadRing.map(total);
+		if(!mapped)
+			return false;
+		
+		std::vector<int> offsets;
+		int offset = 0;
+		for(auto& tf : fits) {
+			memcpy(mapped + offset, tf.second->bytes, tf.second->numBytes);
+			offsets.push_back(offset);
+			offset += tf.second->numBytes;
+		}
+		uploadRing.unmap();
+		
+		const VideoFrame::Ptr& first = fits.front().second;
+		bool layout = planeCount == 0;
+		if(layout) {
+			planeCount = first->numPlanes;
+			interleavedChroma = first->format == PIX_FMT_NV12;
+			yuvToRgb(first->colorSpace, first->fullRange, first->height, yuvMatrix, yuvOffset);
+		}
+		
+		// yuv planes are tightly packed
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		
+		// a plane at a time, so each array is bound once for every tile's layer
+		for(int i=0; i<planeCount; i++) {
+			bool rg = interleavedChroma && i == 1;
+			GLenum uploadFormat = rg ? GL_RG : GL_RED;
+			
+			Texture::setActiveUnit(i);
+			planes[i].bind();
+			if(layout) {
+				planes[i].format = rg ? GL_RG8 : GL_R8;
+				planes[i].allocateLayers(first->planeWidths[i], first->planeHeights[i], maxTiles, uploadFormat);
+			}
+			for(size_t t=0; t<fits.size(); t++) {
+				const VideoFrame::Ptr& f = fits[t].second;
+				planes[i].updateLayer(fits[t].first, uploadFormat, (const GLubyte*)BUFFER_OFFSET(offsets[t] + f->planeOffsets[i]));
+			}
+		}
+		Texture::setActiveUnit(0);
+		
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		uploadRing.fence();
+		
+		for(auto& tf : fits)
+			tiles[tf.first].shown = true;
+		stats.uploads += fits.size();
+		return true;
+	}
+	
+	void VideoWall::draw(double time) {
+		auto start = std::chrono::steady_clock::now();
+		stats.frames++;
+		
+		std::vector<std::pair<int, VideoFrame::Ptr>> frames;
+		for(int i=0; i<(int)tiles.size(); i++) {
+			// anything that would finish before now isn't worth converting
+			tiles[i].decoder->setLateTime(time);
+			if(VideoFrame::Ptr f = tiles[i].decoder->frameForTime(time))
+				frames.push_back(std::make_pair(i, f));
+		}
+		upload(frames);
+		frames.clear();
+		
+		auto uploaded = std::chrono::steady_clock::now();
+		stats.uploadTime += std::chrono::duration<double>(uploaded - start).count();
+		
+		// only tiles with something in their layer
+		instanceData.clear();
+		for(int i=0; i<(int)tiles.size(); i++) {
+			const Tile& tile = tiles[i];
+			if(!tile.visible || !tile.shown)
+				continue;
+			
+			instanceData.push_back(tile.rect.x);
+			instanceData.push_back(tile.rect.y);
+			instanceData.push_back(tile.rect.z);
+			instanceData.push_back(tile.rect.w);
+			instanceData.push_back((float)i);
+		}
+		
+		GLsizei count = (GLsizei)(instanceData.size() / InstanceFloats);
+		if(count > 0) {
+			instances.bind();
+			instances.upload(instanceData.size() * sizeof(float), &instanceData[0]);
+			
+			// put back whatever program the caller had bound
+			ScopedBind bound(*program);
+			program->setUniform(program->getUniformLocation("yTex"), 0);
+			program->setUniform(program->getUniformLocation("uTex"), 1);
+			program->setUniform(program->getUniformLocation("vTex"), 2);
+			program->setUniform(program->getUniformLocation("interleaved"), interleavedChroma ? 1 : 0);
+			program->setUniform(program->getUniformLocation("yuvMatrix"), yuvMatrix);
+			program->setUniform(program->getUniformLocation("yuvOffset"), yuvOffset);
+			
+			for(int i=0; i<planeCount; i++) {
+				Texture::setActiveUnit(i);
+				planes[i].bind();
+			}
+			Texture::setActiveUnit(0);
+			
+			vao.bind();
+			glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, count);
+			stats.drawCalls++;
+		}
+		
+		stats.drawTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - uploaded).count();
+	}
+
+}
@@ -0,0 +1,89 @@
+//
+//  wall.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include "render.h"
+
+#include <vector>
+#include <memory>
+
+namespace jf {
+	
+	class VideoDecoder;
+	struct VideoFrame;
+	
+	// lots of movies the same size drawn with one instanced call. each tile's
+	// frames go into its own layer of a texture array per yuv plane, and its
+	// rect and layer are per instance attributes. the decoders have to put
+	// out yuv at the wall's size, setOutputFormat(OutputYUV) and
+	// setOutputSize() do that, anything else gets skipped
+	class VideoWall {
+	public:
+		// cpu time spent in draw(), split into getting frames into the
+		// texture arrays and everything after
+		struct Stats {
+			int64_t frames;
+			int64_t uploads;
+			int64_t rejected;
+			int64_t drawCalls;
+			double uploadTime, drawTime;
+		};
+		
+		// program is wall.vert + wall.frag, attribs corner 0, rect 1 and layer 2.
+		// every tile's frames are width by height. NULL if the texture arrays
+		// can't have maxTiles layers
+		static VideoWall* create(Program* program, int width, int height, int maxTiles);
+		~VideoWall();
+		
+		// the decoder stays the caller's and has to outlive the wall. the
+		// tile is hidden until it has a rect. -1 once the wall is full
+		int add(VideoDecoder* decoder);
+		// the picture is fit inside, centred
+		void setRect(int tile, float x, float y, float w, float h);
+		void setVisible(int tile, bool visible);
+		int getTileCount() const;
+		
+		// uploads whatever frame is due at time for every tile and draws the
+		// visible ones in a single call
+		void draw(double time);
+		Stats getStats() const;
+	
+	private:
+		struct Tile {
+			VideoDecoder* decoder;
+			glm::vec4 rect;
+			bool visible;
+			// its layer has a frame in it
+			bool shown;
+		};
+		
+		VideoWall();
+		// all of this draw's new frames through one pbo, false if none uploaded
+		bool upload(const std::vector<std::pair<int, std::shared_ptr<VideoFrame>>>& frames);
+		
+		Program* program;
+		int width, height, maxTiles;
+		std::vector<Tile> tiles;
+		
+		// one array per yuv plane, laid out by the first frame
+		Texture planes[3];
+		int planeCount;
+		bool interleavedChroma;
+		glm::mat3 yuvMatrix;
+		glm::vec3 yuvOffset;
+		
+		PixelBufferRing uploadRing;
+		VertexArray vao;
+		Buffer quad;
+		Buffer instances;
+		std::vector<float> instanceData;
+		
+		Stats stats;
+	};
+
+}
@@ -0,0 +1,96 @@
+//
+//  workers.cpp
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#include "workers.h"
+
+#include <algorithm>
+
+namespace jf {
+	
+	WorkerPool& WorkerPool::shared() {
+		static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+		return pool;
+	}
+	
+	WorkerPool::WorkerPool(int n)
+	:	quit(false)
+	{
+		for(int i=0; i<n; i++)
+			threads.push_back(std::thread(&WorkerPool::work, this));
+	}
+	
+	WorkerPool::~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		
+		for(auto& t : threads)
+			t.join();
+	}
+	
+	int WorkerPool::getThreadCount() const {
+		return (int)threads.size();
+	}
+	
+	void WorkerPool::run(int count, const std::function<void(int)>& task) {
+		if(count <= 0)
+			return;
+		
+		// nobody to share with
+		if(count == 1 || threads.empty()) {
+			for(int i=0; i<count; i++)
+				task(i);
+			return;
+		}
+		
+		// the job lives on our stack, we don't return until the last piece is done
+		Job job = { &task, count, 0, 0 };
+		
+		std::unique_lock<std::mutex> lock(mutex);
+		jobs.push_back(&job);
+		wake.notify_all();
+		
+		// pitch in rather than sit idle
+		while(job.next < job.count) {
+			int i = take(&job);
+			lock.unlock();
+			task(i);
+			lock.lock();
+			job.done++;
+		}
+		
+		finished.wait(lock, [&job]() { return job.done == job.count; });
+	}
+	
+	int WorkerPool::take(Job* job) {
+		int i = job->next++;
+		if(job->next == job->count)
+			jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+		return i;
+	}
+	
+	void WorkerPool::work() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true) {
+			wake.wait(lock, [this]() { return quit || !jobs.empty(); });
+			if(quit)
+				return;
+			
+			Job* job = jobs.front();
+			int i = take(job);
+			lock.unlock();
+			(*job->task)(i);
+			lock.lock();
+			
+			if(++job->done == job->count)
+				finished.notify_all();
+		}
+	}
+	
+}
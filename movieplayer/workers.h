@@ -0,0 +1,53 @@
+//
+//  workers.h
+//  movieplayer
+//
+//  Created by agent on 10/17/26.
+//
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <deque>
+
+namespace jf {
+	
+	// threads shared by every movie for splitting short, cpu bound jobs into pieces
+	class WorkerPool {
+	public:
+		// one thread per core, less the one that's calling run
+		static WorkerPool& shared();
+		~WorkerPool();
+		
+		int getThreadCount() const;
+		
+		// runs task(0) through task(count-1) on the pool and the calling
+		// thread, returns once they've all finished
+		void run(int count, const std::function<void(int)>& task);
+		
+	private:
+		WorkerPool(int threads);
+		WorkerPool(const WorkerPool&) =delete;
+		WorkerPool& operator=(const WorkerPool&) =delete;
+		
+		struct Job {
+			const std::function<void(int)>* task;
+			int count, next, done;
+		};
+		
+		// hands out the next piece of job, called with mutex held
+		int take(Job* job);
+		void work();
+		
+		std::mutex mutex;
+		std::condition_variable wake, finished;
+		std::deque<Job*> jobs;
+		std::vector<std::thread> threads;
+		bool quit;
+	};
+	
+}
@@ -0,0 +1,21 @@
+#version 150
+
+uniform sampler2DArray yTex, uTex, vTex;
+uniform int interleaved;	// NV12, both chroma channels live in uTex
+uniform mat3 yuvMatrix;
+uniform vec3 yuvOffset;
+
+in vec3 coords;
+
+out vec4 color;
+
+void main() {
+	vec3 yuv;
+	yuv.x = texture(yTex,coords).r;
+	if(interleaved == 1)
+		yuv.yz = texture(uTex,coords).rg;
+	else
+		yuv.yz = vec2(texture(uTex,coords).r, texture(vTex,coords).r);
+	
+	color = vec4(yuvMatrix * (yuv - yuvOffset), 1.0);
+}
\ No newline at end of file
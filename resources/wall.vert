@@ -0,0 +1,14 @@
+#version 150
+
+uniform mat4 viewMatrix, projectionMatrix;
+
+in vec2 corner;	// of the unit quad
+in vec4 rect;	// per tile, x y w h
+in float layer;	// per tile, its slice of the texture arrays
+
+out vec3 coords;
+
+void main() {
+	coords = vec3(corner.x, 1.0 - corner.y, layer);
+	gl_Position = projectionMatrix * viewMatrix * vec4(rect.xy + corner * rect.zw,0.0,1.0);
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#version 150
+
+uniform sampler2D yTex, uTex, vTex;
+uniform int interleaved;	// NV12, both chroma channels live in uTex
+uniform mat3 yuvMatrix;
+uniform vec3 yuvOffset;
+uniform int filtered;		// drawn at half to full size, average four taps instead of mips
+uniform vec2 texelSize;		// of yTex
+
+in vec2 coords;
+
+out vec4 color;
+
+vec3 sampleYUV(vec2 at) {
+	vec3 yuv;
+	yuv.x = texture(yTex,at).r;
+	if(interleaved == 1)
+		yuv.yz = texture(uTex,at).rg;
+	else
+		yuv.yz = vec2(texture(uTex,at).r, texture(vTex,at).r);
+	return yuv;
+}
+
+void main() {
+	vec3 yuv;
+	if(filtered == 1) {
+		// each bilinear tap half a texel out covers the 2x2 a half size pixel spans
+		vec2 d = texelSize * 0.5;
+		yuv = 0.25 * (sampleYUV(coords + vec2(-d.x,-d.y)) + sampleYUV(coords + vec2(d.x,-d.y))
+					+ sampleYUV(coords + vec2(-d.x,d.y)) + sampleYUV(coords + vec2(d.x,d.y)));
+	}
+	else
+		yuv = sampleYUV(coords);
+	
+	color = vec4(yuvMatrix * (yuv - yuvOffset), 1.0);
+}
\ No newline at end of file